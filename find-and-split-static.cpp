@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <llvm/Analysis/CallGraph.h>
@@ -13,19 +15,21 @@
 #include <llvm/IRReader/IRReader.h>
 #include <llvm/Support/Casting.h>
 #include <llvm/Support/CommandLine.h>
+#include <llvm/Support/JSON.h>
 #include <llvm/Support/SourceMgr.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Transforms/Utils/Cloning.h>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <queue>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 
-static llvm::LLVMContext context;
-llvm::SMDiagnostic err;
-
 llvm::cl::opt<std::string> InputFilename(llvm::cl::Positional, llvm::cl::desc("<input file>"));
 
 llvm::cl::opt<std::string> ExtractFunction("e", llvm::cl::desc("Function to extract."),
@@ -33,6 +37,14 @@ llvm::cl::opt<std::string> ExtractFunction("e", llvm::cl::desc("Function to extr
 
 llvm::cl::opt<bool> Verbose("v", llvm::cl::desc("Enable verbose output."));
 
+llvm::cl::opt<std::string> JsonReport("json",
+									  llvm::cl::desc("Write the analysis of every function "
+													 "as JSON to this file."),
+									  llvm::cl::value_desc("filename"));
+
+llvm::cl::opt<unsigned> Jobs("j", llvm::cl::desc("Number of threads used for the analysis."),
+							 llvm::cl::init(std::max(1u, std::thread::hardware_concurrency())));
+
 std::unordered_map<llvm::GlobalValue::LinkageTypes, std::string> linkageTypes = {
 	{llvm::GlobalValue::LinkageTypes::ExternalLinkage, "(external)"},
 	{llvm::GlobalValue::LinkageTypes::AvailableExternallyLinkage, "(available externally)"},
@@ -95,163 +107,394 @@ std::unordered_set<llvm::GlobalVariable *> getUses(const llvm::Function &functio
 	return globals;
 }
 
-int main(int argc, char **argv)
+/**
+ * @return A printable name for `linkage`. Unlike indexing `linkageTypes`,
+ * this does not modify the map, so it is safe to call from several threads.
+ */
+std::string describeLinkage(llvm::GlobalValue::LinkageTypes linkage)
 {
-	llvm::cl::ParseCommandLineOptions(argc, argv);
-	std::ifstream fileList(InputFilename);
-	std::unordered_map<std::string, const llvm::Function *> definedFunctions;
-	std::string file;
-	std::vector<std::unique_ptr<llvm::Module>> loadedModules;
+	auto found = linkageTypes.find(linkage);
+	return found != linkageTypes.end() ? found->second : std::to_string(linkage);
+}
 
-	while (std::getline(fileList, file))
+/**
+ * @return A printable name for `visibility`.
+ */
+std::string describeVisibility(llvm::GlobalValue::VisibilityTypes visibility)
+{
+	auto found = visibilityTypes.find(visibility);
+	return found != visibilityTypes.end() ? found->second : "";
+}
+
+/**
+ * Call `body(index)` for every index below `count`, from `Jobs` threads.
+ */
+template <typename Body> void parallelFor(size_t count, Body body)
+{
+	std::atomic<size_t> next{0};
+	std::vector<std::thread> threads;
+	for (unsigned thread = 0; thread < std::min<size_t>(Jobs, count); thread++)
 	{
-		if (std::unique_ptr<llvm::Module> module = llvm::parseIRFile(file, err, context))
-		{
-			for (auto const &function : module->functions())
+		threads.emplace_back(
+			[&]
 			{
-				if (!function.isDeclaration())
+				for (auto index = next++; index < count; index = next++)
 				{
-					definedFunctions.emplace(function.getName().str(), &function);
+					body(index);
 				}
-			}
+			});
+	}
+	for (auto &thread : threads)
+	{
+		thread.join();
+	}
+}
 
-			loadedModules.push_back(std::move(module));
-		}
-		else
+/**
+ * A loaded module and what the analysis needs to know about it, built
+ * once for all of its functions instead of once per function. Every
+ * module has its own context, so the modules can be loaded and indexed
+ * in parallel; after that they are only read.
+ */
+struct AnalyzedModule
+{
+	std::string file;
+	std::unique_ptr<llvm::LLVMContext> context;
+	std::unique_ptr<llvm::Module> module;
+	std::unique_ptr<llvm::CallGraph> callGraph;
+
+	/**
+	 * @return The functions called by `function`, from the call graph.
+	 */
+	std::vector<const llvm::Function *> callees(const llvm::Function *function) const
+	{
+		std::vector<const llvm::Function *> result;
+		for (const auto &[_, node] : *(*callGraph)[function])
 		{
-			err.print(file.c_str(), llvm::outs());
+			if (node->getFunction() != nullptr)
+			{
+				result.push_back(node->getFunction());
+			}
 		}
+		return result;
 	}
 
-	for (const auto &module : loadedModules)
+	/**
+	 * @return The constant globals used by `function`, computed the first
+	 * time they are asked for.
+	 */
+	const std::vector<std::string> &constantUses(const llvm::Function *function)
 	{
-		for (auto const &function : module->functions())
 		{
-			if (function.isDeclaration())
+			std::lock_guard<std::mutex> guard(usesLock);
+			auto found = uses.find(function);
+			if (found != uses.end())
 			{
-				definedFunctions.erase(function.getName().str());
+				return found->second;
 			}
 		}
-	}
 
-	for (auto &[key, value] : definedFunctions)
-	{
-		auto linkage = linkageTypes[value->getLinkage()];
-		if (linkage.length() == 0)
+		std::vector<std::string> names;
+		for (auto global : getUses(*function))
 		{
-			linkage = std::to_string(value->getLinkage());
+			names.push_back(global->getName().str());
 		}
-		auto visibility = visibilityTypes[value->getVisibility()];
+		std::sort(names.begin(), names.end());
+
+		std::lock_guard<std::mutex> guard(usesLock);
+		return uses.emplace(function, std::move(names)).first->second;
+	}
 
-		std::stringstream out;
-		std::stringstream command;
+  private:
+	std::mutex usesLock;
+	std::unordered_map<const llvm::Function *, std::vector<std::string>> uses;
+};
 
-		// TODO: Const washing is a bad thing.
-		llvm::Module *module = (llvm::Module *) value->getParent();
-		command << "llvm-extract " << module->getName().str()
-				<< " --func=" << value->getName().str() << " ";
+/**
+ * Whether a function can be split out on its own, and why not.
+ */
+struct Viability
+{
+	Viability(const llvm::Function *function, AnalyzedModule *module)
+		: function(function), module(module)
+	{
+	}
 
-		auto callGraph = new llvm::CallGraph(*module);
-		bool viable = true;
-		if (value->getName().str() == ExtractFunction)
+	const llvm::Function *function;
+	AnalyzedModule *module;
+	bool viable = true;
+	std::vector<std::string> reasons;
+	std::vector<const llvm::Function *> callees;
+	std::vector<const llvm::Function *> callers;
+	std::vector<std::string> globals;
+	std::string details;
+	std::string command;
+};
+
+/**
+ * Decide whether `result.function` can be split out: it must not call
+ * internal functions, be used by internal functions, be stored or passed
+ * as an argument (have its address taken), or be used by other globals
+ * or constants.
+ */
+void analyze(Viability &result)
+{
+	auto value = result.function;
+	bool extracted = value->getName() == ExtractFunction;
+	std::stringstream out;
+	std::stringstream command;
+	command << "llvm-extract " << result.module->module->getName().str()
+			<< " --func=" << value->getName().str() << " ";
+
+	auto reject = [&](const std::string &reason)
+	{
+		result.viable = false;
+		result.reasons.push_back(reason);
+	};
+
+	result.callees = result.module->callees(value);
+	for (const auto child : result.callees)
+	{
+		if (child->getLinkage() == llvm::GlobalValue::InternalLinkage)
 		{
-			getUses(*value);
+			reject("calls internal function " + child->getName().str());
 		}
+		out << "c- " << child->getName().str() << ": "
+			<< describeVisibility(child->getVisibility()) << " "
+			<< describeLinkage(child->getLinkage()) << std::endl;
+	}
 
-		for (const auto &[_, node] : *callGraph->getOrInsertFunction(value))
+	for (const llvm::User *user : value->users())
+	{
+		if (auto *instruction = llvm::dyn_cast<llvm::Instruction>(user))
 		{
-			if (node->getFunction() == nullptr)
+			auto function = instruction->getParent()->getParent();
+			if (function->getLinkage() == llvm::GlobalValue::InternalLinkage)
 			{
-				continue;
+				reject("used by internal function " + function->getName().str());
 			}
-			const auto child = node->getFunction();
-			if (child->getLinkage() == llvm::GlobalValue::InternalLinkage)
+			if (instruction->getOpcode() == llvm::Instruction::Store)
 			{
-				viable = false;
+				reject("stored by " + function->getName().str());
 			}
-			out << "c- " << child->getName().str() << ": "
-				<< visibilityTypes[child->getVisibility()] << " "
-				<< linkageTypes[child->getLinkage()] << std::endl;
-		}
-
-		for (const llvm::User *user : value->users())
-		{
-			if (auto *instruction = llvm::dyn_cast<llvm::Instruction>(user))
+			if (auto callInstruction = llvm::dyn_cast<llvm::CallBase>(instruction))
 			{
-				auto function = instruction->getParent()->getParent();
-				if (function->getLinkage() == llvm::GlobalValue::InternalLinkage ||
-					instruction->getOpcode() == llvm::Instruction::Store)
-				{
-					viable = false;
-				}
-				if (auto callInstruction = llvm::dyn_cast<llvm::CallBase>(instruction))
+				// if the instruction that references this function isn't calling it
+				// it is being passed as argument. And we don't want functions which
+				// have their addresses taken.
+				if (callInstruction->getCalledFunction() != value)
 				{
-
-					// if the instruction that references this function isn't calling it
-					// it is being passed as argument. And we don't want functions which
-					// have their addresses taken.
-					if (callInstruction->getCalledFunction() != value)
-					{
-						viable = false;
-					}
+					reject("address taken by " + function->getName().str());
 				}
+			}
+			result.callers.push_back(function);
 
-				out << "Inst: " << instruction->getOpcodeName() << "<" << instruction->getOpcode()
-					<< ">" << function->getName().str() << ": "
-					<< visibilityTypes[function->getVisibility()] << " "
-					<< linkageTypes[function->getLinkage()] << "\n";
+			out << "Inst: " << instruction->getOpcodeName() << "<" << instruction->getOpcode()
+				<< ">" << function->getName().str() << ": "
+				<< describeVisibility(function->getVisibility()) << " "
+				<< describeLinkage(function->getLinkage()) << "\n";
 
-				command << "--func=" << function->getName().str() << " ";
-				if (value->getName().str() == ExtractFunction)
+			command << "--func=" << function->getName().str() << " ";
+			if (extracted)
+			{
+				for (const auto &global : result.module->constantUses(function))
 				{
-					for (auto global : getUses(*function))
-					{
-						command << "--glob=" << global->getName().str() << " ";
-					}
+					result.globals.push_back(global);
+					command << "--glob=" << global << " ";
 				}
+			}
 
-				for (const auto &[_, node] : *callGraph->getOrInsertFunction(function))
-				{
-					if (node->getFunction() == nullptr)
-					{
-						continue;
-					}
-					const auto child = node->getFunction();
-					if (child->getLinkage() == llvm::GlobalValue::InternalLinkage)
-					{
-						// viable = false;
-					}
-					out << "u- \t\t" << child->getName().str() << ": "
-						<< visibilityTypes[child->getVisibility()] << " "
-						<< linkageTypes[child->getLinkage()] << std::endl;
-				}
+			for (const auto child : result.module->callees(function))
+			{
+				out << "u- \t\t" << child->getName().str() << ": "
+					<< describeVisibility(child->getVisibility()) << " "
+					<< describeLinkage(child->getLinkage()) << std::endl;
 			}
-			else if (auto *globalValue = llvm::dyn_cast<llvm::GlobalValue>(user))
+		}
+		else if (auto *globalValue = llvm::dyn_cast<llvm::GlobalValue>(user))
+		{
+			out << "g- " << globalValue->getName().str() << "\n";
+			reject("used by global " + globalValue->getName().str());
+		}
+		else
+		{
+			reject("used by a constant");
+			if (auto *constant = llvm::dyn_cast<llvm::Constant>(user))
 			{
-				out << "g- " << globalValue->getName().str() << "\n";
-				viable = false;
+				out << "const- " << constant->getType() << "\n";
 			}
-			else
+		}
+	}
+	command << "-o split1.bc";
+
+	result.details = out.str();
+	result.command = command.str();
+}
+
+/**
+ * Write the analysis of every function to `path` as JSON.
+ */
+bool writeReport(const std::string &path, const std::vector<Viability> &results)
+{
+	std::error_code ecode;
+	llvm::raw_fd_ostream output(path, ecode);
+	if (ecode)
+	{
+		llvm::errs() << path << ": " << ecode.message() << "\n";
+		return false;
+	}
+
+	auto names = [](llvm::json::OStream &json, const std::vector<const llvm::Function *> &functions)
+	{
+		std::set<std::string> sorted;
+		for (auto function : functions)
+		{
+			sorted.insert(function->getName().str());
+		}
+		for (const auto &name : sorted)
+		{
+			json.value(name);
+		}
+	};
+
+	llvm::json::OStream json(output, 2);
+	json.array(
+		[&]
+		{
+			for (const auto &result : results)
 			{
-				viable = false;
-				if (auto *constant = llvm::dyn_cast<llvm::Constant>(user))
+				json.object(
+					[&]
+					{
+						json.attribute("function", result.function->getName());
+						json.attribute("module", result.module->file);
+						json.attribute("linkage", describeLinkage(result.function->getLinkage()));
+						json.attribute("visibility",
+									   describeVisibility(result.function->getVisibility()));
+						json.attribute("viable", result.viable);
+						json.attributeArray("reasons",
+											[&]
+											{
+												for (const auto &reason : result.reasons)
+												{
+													json.value(reason);
+												}
+											});
+						json.attributeArray("callees", [&] { names(json, result.callees); });
+						json.attributeArray("callers", [&] { names(json, result.callers); });
+						if (!result.globals.empty())
+						{
+							json.attributeArray("globals",
+												[&]
+												{
+													for (const auto &global : result.globals)
+													{
+														json.value(global);
+													}
+												});
+						}
+						json.attribute("command", result.command);
+					});
+			}
+		});
+	output << "\n";
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	llvm::cl::ParseCommandLineOptions(argc, argv);
+	std::ifstream fileList(InputFilename);
+	std::vector<std::unique_ptr<AnalyzedModule>> modules;
+	std::string file;
+	while (std::getline(fileList, file))
+	{
+		modules.push_back(std::make_unique<AnalyzedModule>());
+		modules.back()->file = file;
+	}
+
+	// Load every module and build its call graph once.
+	std::mutex outputLock;
+	parallelFor(modules.size(),
+				[&](size_t index)
 				{
-					out << "const- " << constant->getType() << "\n";
-				}
+					auto &analyzed = *modules[index];
+					llvm::SMDiagnostic err;
+					analyzed.context = std::make_unique<llvm::LLVMContext>();
+					analyzed.module = llvm::parseIRFile(analyzed.file, err, *analyzed.context);
+					if (!analyzed.module)
+					{
+						std::lock_guard<std::mutex> guard(outputLock);
+						err.print(analyzed.file.c_str(), llvm::outs());
+						return;
+					}
+					analyzed.callGraph = std::make_unique<llvm::CallGraph>(*analyzed.module);
+				});
+
+	// The first definition of a name wins, as when the files were read one
+	// after the other.
+	std::map<std::string, Viability> definedFunctions;
+	for (const auto &analyzed : modules)
+	{
+		if (!analyzed->module)
+		{
+			continue;
+		}
+		for (auto const &function : analyzed->module->functions())
+		{
+			if (!function.isDeclaration())
+			{
+				definedFunctions.emplace(function.getName().str(),
+										 Viability(&function, analyzed.get()));
 			}
 		}
-		command << "-o split1.bc" << std::endl;
-		if (ExtractFunction.getNumOccurrences() == 0 || value->getName().str() == ExtractFunction)
+	}
+
+	for (const auto &analyzed : modules)
+	{
+		if (!analyzed->module)
+		{
+			continue;
+		}
+		for (auto const &function : analyzed->module->functions())
 		{
-			if (viable)
+			if (function.isDeclaration())
 			{
-				std::cout << key << ": " << visibility << " " << linkage << std::endl;
-				if (Verbose)
-				{
-					std::cout << out.str();
-				}
-				std::cout << command.str();
+				definedFunctions.erase(function.getName().str());
 			}
 		}
 	}
+
+	std::vector<Viability> results;
+	for (auto &[key, value] : definedFunctions)
+	{
+		if (ExtractFunction.getNumOccurrences() == 0 || key == ExtractFunction ||
+			!JsonReport.empty())
+		{
+			results.push_back(std::move(value));
+		}
+	}
+	parallelFor(results.size(), [&](size_t index) { analyze(results[index]); });
+
+	for (const auto &result : results)
+	{
+		auto value = result.function;
+		if (!result.viable ||
+			(ExtractFunction.getNumOccurrences() != 0 && value->getName() != ExtractFunction))
+		{
+			continue;
+		}
+		std::cout << value->getName().str() << ": " << describeVisibility(value->getVisibility())
+				  << " " << describeLinkage(value->getLinkage()) << std::endl;
+		if (Verbose)
+		{
+			std::cout << result.details;
+		}
+		std::cout << result.command << std::endl;
+	}
+
+	if (!JsonReport.empty() && !writeReport(JsonReport, results))
+	{
+		return 1;
+	}
 }
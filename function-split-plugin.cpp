@@ -0,0 +1,110 @@
+/*
+ * The pass plugin registering FunctionSplitPass as `function-split`:
+ *
+ *   opt -load-pass-plugin ./function-split.so \
+ *       -passes='function-split<output=out;partitions=4>' program.bc
+ *
+ * The parameters are optional, and default to the `-function-split-*`
+ * options, which are only known to a tool that loaded the plugin
+ * before parsing its options (`opt -load ./function-split.so` or
+ * `clang -Xclang -load -Xclang ./function-split.so`).
+ */
+
+#include "function-split.h"
+
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Passes/PassPlugin.h>
+#include <llvm/Support/CommandLine.h>
+
+static llvm::cl::opt<std::string>
+	outputDirectory("function-split-output",
+					llvm::cl::desc("Where function-split writes the modules."),
+					llvm::cl::init("."));
+
+static llvm::cl::opt<unsigned>
+	partitions("function-split-partitions",
+			   llvm::cl::desc("Group the functions into this many modules instead of one "
+							  "module per function."));
+
+static llvm::cl::opt<unsigned> jobs("function-split-jobs",
+									llvm::cl::desc("Number of threads writing the modules."));
+
+static llvm::cl::opt<bool>
+	atEnd("function-split-at-end",
+		  llvm::cl::desc("Split at the end of the optimization pipeline, as with "
+						 "-passes=function-split after it."));
+
+/**
+ * Parse the parameters of `function-split<...>`, a `;` separated list of
+ * `output=<dir>`, `partitions=<n>` and `jobs=<n>`.
+ *
+ * @return Whether they are all valid.
+ */
+static bool parseOptions(llvm::StringRef parameters, functionSplit::Options &options)
+{
+	while (!parameters.empty())
+	{
+		llvm::StringRef parameter;
+		std::tie(parameter, parameters) = parameters.split(';');
+		auto [key, value] = parameter.split('=');
+		if (key == "output")
+		{
+			options.outputDirectory = value.str();
+		}
+		else if ((key == "partitions" && !value.getAsInteger(10, options.partitions)) ||
+				 (key == "jobs" && !value.getAsInteger(10, options.jobs)))
+		{
+			continue;
+		}
+		else
+		{
+			llvm::errs() << "function-split: invalid parameter '" << parameter << "'\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+static functionSplit::Options defaultOptions()
+{
+	functionSplit::Options options;
+	options.outputDirectory = outputDirectory;
+	options.partitions = partitions;
+	options.jobs = jobs;
+	return options;
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo()
+{
+	return {LLVM_PLUGIN_API_VERSION, "function-split", "1",
+			[](llvm::PassBuilder &builder)
+			{
+				builder.registerPipelineParsingCallback(
+					[](llvm::StringRef name, llvm::ModulePassManager &manager,
+					   llvm::ArrayRef<llvm::PassBuilder::PipelineElement>)
+					{
+						if (!name.consume_front("function-split"))
+						{
+							return false;
+						}
+						auto options = defaultOptions();
+						if (!name.empty() &&
+							(!name.consume_front("<") || !name.consume_back(">") ||
+							 !parseOptions(name, options)))
+						{
+							return false;
+						}
+						manager.addPass(functionSplit::FunctionSplitPass(options));
+						return true;
+					});
+
+				builder.registerOptimizerLastEPCallback(
+					[](llvm::ModulePassManager &manager, llvm::OptimizationLevel)
+					{
+						if (atEnd)
+						{
+							manager.addPass(functionSplit::FunctionSplitPass(defaultOptions()));
+						}
+					});
+			}};
+}
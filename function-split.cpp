@@ -0,0 +1,4538 @@
+/*
+ * The function splitter library (see function-split.h): the stages of
+ * split-llvm-extract, which is a command line front end to it, and the
+ * pass running them on a module in memory.
+ *
+ * The extraction is done in-process on the already loaded module,
+ * in the same way `llvm-extract` would do it, so the input is only
+ * ever parsed once.
+ */
+
+#include "function-split.h"
+#include "llvm/IR/GlobalObject.h"
+#include "split-archive.h"
+#include "split-partition.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <llvm/ADT/SCCIterator.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Analysis/CallGraph.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Argument.h>
+#include <llvm/IR/Constant.h>
+#include <llvm/IR/DebugInfo.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/DerivedUser.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalValue.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstVisitor.h>
+#include <llvm/IR/InstrTypes.h>
+#include <llvm/IR/Instruction.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/ModuleSlotTracker.h>
+#include <llvm/IR/Operator.h>
+#include <llvm/IR/Use.h>
+#include <llvm/IR/User.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/IRReader/IRReader.h>
+#if LLVM_VERSION_MAJOR >= 14
+#include <llvm/MC/TargetRegistry.h>
+#else
+#include <llvm/Support/TargetRegistry.h>
+#endif
+#include <llvm/Pass.h>
+#include <llvm/Support/Casting.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+
+#include <assert.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <stack>
+#include <thread>
+#include <typeinfo>
+
+namespace functionSplit
+{
+
+// Changing how modules are extracted must change this, so that the
+// modules written by older versions are not considered up to date.
+const char *manifestVersion = "split-llvm-extract manifest 5";
+
+std::mutex outputMutex;
+
+/**
+ * Add `value` to `total`, saturating instead of overflowing. The number
+ * of visits a naive walk of a shared constant expression DAG makes can
+ * grow exponentially with its depth.
+ */
+static void addVisits(uint64_t &total, uint64_t value)
+{
+	total = value > UINT64_MAX - total ? UINT64_MAX : total + value;
+}
+
+/**
+ * Finds the constant global variables referenced through the
+ * operands of constants.
+ *
+ * A global variable reached this way is recorded if it is a constant,
+ * but its initializer is not walked, that is left to the
+ * GlobalDependencyGraph. The result for every constant is memoized,
+ * so constant expression DAGs shared between many users (like tables
+ * of pointers to string literals) are only ever walked once.
+ *
+ * Globals are referred to by their index in the module, so that the
+ * results can be shared between copies of the same module.
+ */
+class ConstantOperandCache
+{
+  public:
+	explicit ConstantOperandCache(llvm::Module &module)
+	{
+		for (auto &global : module.globals())
+		{
+			indices.emplace(&global, globals.size());
+			globals.push_back(&global);
+		}
+	}
+
+	llvm::GlobalVariable *global(unsigned index) const
+	{
+		return globals[index];
+	}
+
+	unsigned index(const llvm::GlobalVariable *global) const
+	{
+		return indices.at(global);
+	}
+
+	size_t size() const
+	{
+		return globals.size();
+	}
+
+	/**
+	 * @return The sorted indices of the constant globals referenced by
+	 * `constant`, itself included if it is a constant global.
+	 */
+	const std::vector<unsigned> &globalsOf(const llvm::Constant &constant)
+	{
+		return visit(constant).globals;
+	}
+
+	/**
+	 * @return The sorted indices of the constant globals referenced by the
+	 * operands of `user`. Operands which are instructions are skipped, they
+	 * are visited on their own.
+	 */
+	std::vector<unsigned> operandGlobals(const llvm::User &user)
+	{
+		std::vector<unsigned> result;
+		for (const auto &operand : user.operands())
+		{
+			if (auto constant = llvm::dyn_cast<llvm::Constant>(operand))
+			{
+				const auto &found = globalsOf(*constant);
+				result.insert(result.end(), found.begin(), found.end());
+			}
+		}
+		std::sort(result.begin(), result.end());
+		result.erase(std::unique(result.begin(), result.end()), result.end());
+		return result;
+	}
+
+	/**
+	 * @return The sorted indices of the mutable global variables the
+	 * operands of `user` reference, directly or through constant
+	 * expressions (but not through the initializers of other globals).
+	 */
+	std::vector<unsigned> operandVariables(const llvm::User &user)
+	{
+		std::vector<unsigned> result;
+		for (const auto &operand : user.operands())
+		{
+			if (auto constant = llvm::dyn_cast<llvm::Constant>(operand))
+			{
+				const auto &found = visit(*constant).variables;
+				result.insert(result.end(), found.begin(), found.end());
+			}
+		}
+		std::sort(result.begin(), result.end());
+		result.erase(std::unique(result.begin(), result.end()), result.end());
+		return result;
+	}
+
+	/**
+	 * @return The number of values the old stack based walk, which had no
+	 * memoization, popped when starting from the operands of `user`.
+	 */
+	uint64_t naiveOperandVisits(const llvm::User &user)
+	{
+		uint64_t total = 0;
+		for (const auto &operand : user.operands())
+		{
+			if (auto constant = llvm::dyn_cast<llvm::Constant>(operand))
+			{
+				addVisits(total, visit(*constant).naiveVisits);
+			}
+			else if (auto instruction = llvm::dyn_cast<llvm::Instruction>(operand))
+			{
+				addVisits(total, 1);
+				for (const auto &nextOperand : instruction->operands())
+				{
+					if (auto constant = llvm::dyn_cast<llvm::Constant>(nextOperand))
+					{
+						addVisits(total, visit(*constant).naiveVisits);
+					}
+					else if (!llvm::isa<llvm::Instruction>(nextOperand))
+					{
+						addVisits(total, 1);
+					}
+				}
+			}
+			else
+			{
+				addVisits(total, 1);
+			}
+		}
+		return total;
+	}
+
+	// The number of operands actually looked at.
+	uint64_t operandVisits = 0;
+
+  private:
+	struct Entry
+	{
+		std::vector<unsigned> globals;
+		std::vector<unsigned> variables;
+		uint64_t naiveVisits = 0;
+		bool expanded = false;
+		bool done = false;
+	};
+
+	std::vector<llvm::GlobalVariable *> globals;
+	std::unordered_map<const llvm::GlobalVariable *, unsigned> indices;
+	std::unordered_map<const llvm::Constant *, Entry> cache;
+
+	/**
+	 * Walks the constant in post-order with an explicit stack, as nested
+	 * constant expressions can be deep. Cycles (a function being its own
+	 * personality, for example) are cut when reaching a constant which is
+	 * still being expanded.
+	 */
+	const Entry &visit(const llvm::Constant &root)
+	{
+		auto found = cache.find(&root);
+		if (found != cache.end() && found->second.done)
+		{
+			return found->second;
+		}
+
+		std::stack<const llvm::Constant *> pending;
+		pending.push(&root);
+		while (pending.size() > 0)
+		{
+			auto current = pending.top();
+			auto &entry = cache[current];
+
+			if (entry.done)
+			{
+				pending.pop();
+				continue;
+			}
+
+			if (auto globalVariable = llvm::dyn_cast<llvm::GlobalVariable>(current))
+			{
+				operandVisits++;
+				entry.naiveVisits = 1;
+				if (globalVariable->isConstant())
+				{
+					entry.globals.push_back(indices.at(globalVariable));
+				}
+				else
+				{
+					entry.variables.push_back(indices.at(globalVariable));
+				}
+				entry.done = true;
+				pending.pop();
+				continue;
+			}
+
+			if (!entry.expanded)
+			{
+				entry.expanded = true;
+				for (const auto &operand : current->operands())
+				{
+					auto constant = llvm::dyn_cast<llvm::Constant>(operand);
+					if (!constant)
+					{
+						continue;
+					}
+					auto next = cache.find(constant);
+					if (next == cache.end() || !next->second.expanded)
+					{
+						pending.push(constant);
+					}
+				}
+				continue;
+			}
+
+			entry.naiveVisits = 1;
+			for (const auto &operand : current->operands())
+			{
+				operandVisits++;
+				auto constant = llvm::dyn_cast<llvm::Constant>(operand);
+				if (!constant)
+				{
+					addVisits(entry.naiveVisits, 1);
+					continue;
+				}
+				const auto &next = cache[constant];
+				if (next.done)
+				{
+					entry.globals.insert(entry.globals.end(), next.globals.begin(),
+										 next.globals.end());
+					entry.variables.insert(entry.variables.end(), next.variables.begin(),
+										   next.variables.end());
+					addVisits(entry.naiveVisits, next.naiveVisits);
+				}
+			}
+			std::sort(entry.globals.begin(), entry.globals.end());
+			entry.globals.erase(std::unique(entry.globals.begin(), entry.globals.end()),
+								entry.globals.end());
+			std::sort(entry.variables.begin(), entry.variables.end());
+			entry.variables.erase(std::unique(entry.variables.begin(), entry.variables.end()),
+								  entry.variables.end());
+			entry.done = true;
+			pending.pop();
+		}
+		return cache[&root];
+	}
+};
+
+/**
+ * The module-wide graph of which constant globals each global needs
+ * through its initializer.
+ *
+ * It is built once per module: the edges are stored as a compact
+ * adjacency array, the strongly connected components (constants which
+ * reference each other) are collapsed and the transitive closure of
+ * every component is computed once, in reverse topological order.
+ * Resolving the dependencies of a function is then a union of the
+ * precomputed closures of the constants it references.
+ */
+class GlobalDependencyGraph
+{
+  public:
+	explicit GlobalDependencyGraph(ConstantOperandCache &cache) : edgeOffsets(1, 0)
+	{
+		std::vector<uint64_t> initializerVisits(cache.size(), 0);
+		for (unsigned node = 0; node < cache.size(); node++)
+		{
+			auto global = cache.global(node);
+			if (global->hasInitializer())
+			{
+				auto targets = cache.operandGlobals(*global->getInitializer());
+				edgeTargets.insert(edgeTargets.end(), targets.begin(), targets.end());
+				initializerVisits[node] = cache.naiveOperandVisits(*global->getInitializer());
+			}
+			edgeOffsets.push_back(edgeTargets.size());
+		}
+
+		findComponents();
+
+		// Tarjan's algorithm finds a component only after all of the
+		// components reachable from it, so their closures are ready.
+		for (unsigned index = 0; index < closures.size(); index++)
+		{
+			auto &closure = closures[index];
+			for (auto member : closure)
+			{
+				for (auto target : edges(member))
+				{
+					if (component[target] != index)
+					{
+						const auto &reached = closures[component[target]];
+						closure.insert(closure.end(), reached.begin(), reached.end());
+					}
+				}
+			}
+			closure.erase(std::remove_if(closure.begin(), closure.end(),
+										 [&cache](unsigned node)
+										 { return !cache.global(node)->isConstant(); }),
+						  closure.end());
+			std::sort(closure.begin(), closure.end());
+			closure.erase(std::unique(closure.begin(), closure.end()), closure.end());
+
+			uint64_t visits = 0;
+			for (auto member : closure)
+			{
+				addVisits(visits, initializerVisits[member]);
+			}
+			closureVisits.push_back(visits);
+		}
+	}
+
+	/**
+	 * @return The sorted constant globals which must be moved together
+	 * with the constant global `node`, itself included.
+	 */
+	const std::vector<unsigned> &closure(unsigned node) const
+	{
+		return closures[component[node]];
+	}
+
+	/**
+	 * @return The sorted constant globals needed by the initializer of
+	 * `node`.
+	 */
+	std::vector<unsigned> dependencies(unsigned node) const
+	{
+		std::vector<unsigned> result;
+		for (auto target : edges(node))
+		{
+			const auto &reached = closure(target);
+			result.insert(result.end(), reached.begin(), reached.end());
+		}
+		std::sort(result.begin(), result.end());
+		result.erase(std::unique(result.begin(), result.end()), result.end());
+		return result;
+	}
+
+	/**
+	 * @return The number of operand visits the old breadth-first search
+	 * made walking the initializers of the closure of `node`.
+	 */
+	uint64_t naiveClosureVisits(unsigned node) const
+	{
+		return closureVisits[component[node]];
+	}
+
+	size_t size() const
+	{
+		return component.size();
+	}
+
+	size_t edgeCount() const
+	{
+		return edgeTargets.size();
+	}
+
+	size_t componentCount() const
+	{
+		return closures.size();
+	}
+
+  private:
+	std::vector<size_t> edgeOffsets;
+	std::vector<unsigned> edgeTargets;
+	std::vector<unsigned> component;
+	std::vector<std::vector<unsigned>> closures;
+	std::vector<uint64_t> closureVisits;
+
+	llvm::ArrayRef<unsigned> edges(unsigned node) const
+	{
+		return llvm::makeArrayRef(edgeTargets.data() + edgeOffsets[node],
+								  edgeOffsets[node + 1] - edgeOffsets[node]);
+	}
+
+	/**
+	 * An iterative version of Tarjan's strongly connected components
+	 * algorithm. Each component starts out as the list of its members.
+	 */
+	void findComponents()
+	{
+		const unsigned unvisited = std::numeric_limits<unsigned>::max();
+		const auto nodes = edgeOffsets.size() - 1;
+		std::vector<unsigned> order(nodes, unvisited);
+		std::vector<unsigned> lowLink(nodes, 0);
+		std::vector<bool> onStack(nodes, false);
+		std::vector<unsigned> stack;
+		std::vector<std::pair<unsigned, size_t>> callStack;
+		unsigned counter = 0;
+
+		component.assign(nodes, unvisited);
+		for (unsigned start = 0; start < nodes; start++)
+		{
+			if (order[start] != unvisited)
+			{
+				continue;
+			}
+
+			callStack.emplace_back(start, 0);
+			while (callStack.size() > 0)
+			{
+				auto &[node, next] = callStack.back();
+				if (next == 0)
+				{
+					order[node] = lowLink[node] = counter++;
+					stack.push_back(node);
+					onStack[node] = true;
+				}
+
+				auto targets = edges(node);
+				if (next < targets.size())
+				{
+					auto target = targets[next++];
+					if (order[target] == unvisited)
+					{
+						callStack.emplace_back(target, 0);
+					}
+					else if (onStack[target])
+					{
+						lowLink[node] = std::min(lowLink[node], order[target]);
+					}
+					continue;
+				}
+
+				if (lowLink[node] == order[node])
+				{
+					closures.emplace_back();
+					unsigned member;
+					do
+					{
+						member = stack.back();
+						stack.pop_back();
+						onStack[member] = false;
+						component[member] = closures.size() - 1;
+						closures.back().push_back(member);
+					} while (member != node);
+				}
+
+				auto finished = node;
+				callStack.pop_back();
+				if (callStack.size() > 0)
+				{
+					auto parent = callStack.back().first;
+					lowLink[parent] = std::min(lowLink[parent], lowLink[finished]);
+				}
+			}
+		}
+	}
+};
+
+/**
+ * This is an LLVM instruction visitor.
+ * Instead of manually going over all of the basic blocks
+ * and then iterating over the instruction a visitor is used
+ * to get to the instructions directly.
+ *
+ * It collects the constant globals which have to be moved
+ * together with the visited function and, if `countAccesses` (for
+ * --data-modules), how many instructions access each mutable global
+ * variable.
+ */
+struct MyPass : public llvm::InstVisitor<MyPass>
+{
+	MyPass(ConstantOperandCache &cache, const GlobalDependencyGraph &graph,
+		   bool countAccesses = false)
+		: cache(cache), graph(graph), countAccesses(countAccesses)
+	{
+	}
+
+	void visitInstruction(llvm::Instruction &instruction)
+	{
+		addVisits(naiveVisits, cache.naiveOperandVisits(instruction));
+		for (auto root : cache.operandGlobals(instruction))
+		{
+			addVisits(naiveVisits, graph.naiveClosureVisits(root));
+			if (roots.insert(root).second)
+			{
+				const auto &closure = graph.closure(root);
+				cache.operandVisits += closure.size();
+				globals.insert(closure.begin(), closure.end());
+			}
+		}
+		if (countAccesses)
+		{
+			for (auto variable : cache.operandVariables(instruction))
+			{
+				variableAccesses[variable]++;
+			}
+		}
+	}
+
+	/**
+	 * @return The indices of the collected globals, in the order they
+	 * appear in the module.
+	 */
+	std::vector<unsigned> sortedIndices() const
+	{
+		std::vector<unsigned> indices(globals.begin(), globals.end());
+		std::sort(indices.begin(), indices.end());
+		return indices;
+	}
+
+	/**
+	 * @return The collected globals, in the order they appear in the module.
+	 */
+	std::vector<llvm::GlobalVariable *> sortedGlobals() const
+	{
+		std::vector<llvm::GlobalVariable *> result;
+		for (auto index : sortedIndices())
+		{
+			result.push_back(cache.global(index));
+		}
+		return result;
+	}
+
+	ConstantOperandCache &cache;
+	const GlobalDependencyGraph &graph;
+	bool countAccesses;
+	std::unordered_set<unsigned> roots;
+	std::unordered_set<unsigned> globals;
+	std::unordered_map<unsigned, uint64_t> variableAccesses;
+	// The number of operand visits the per-instruction walk made before.
+	uint64_t naiveVisits = 0;
+};
+
+/**
+ * @return The filename of the function/global/variable using the
+ * debug information. Returns an empty string if no debug info
+ * can be found.
+ */
+std::string getFileName(llvm::GlobalObject &value)
+{
+	llvm::SmallVector<std::pair<unsigned, llvm::MDNode *>, 4> MDs;
+	value.getAllMetadata(MDs);
+	for (auto &MD : MDs)
+	{
+		if (llvm::MDNode *N = MD.second)
+		{
+			if (auto *subProgram = llvm::dyn_cast<llvm::DISubprogram>(N))
+			{
+				return subProgram->getFilename().str();
+			}
+		}
+	}
+	return "";
+}
+
+/**
+ * Write `contents` to `path`, unless the file already holds exactly
+ * these bytes, in which case it is left alone so that its modification
+ * time does not trigger a rebuild.
+ *
+ * @param changed If not null, set to whether the file was written.
+ * @return false if the file could not be written.
+ */
+bool writeIfChanged(const std::string &path, llvm::StringRef contents, bool *changed = nullptr)
+{
+	auto existing = llvm::MemoryBuffer::getFile(path);
+	if (changed)
+	{
+		*changed = !existing || (*existing)->getBuffer() != contents;
+	}
+	if (existing && (*existing)->getBuffer() == contents)
+	{
+		return true;
+	}
+
+	std::error_code ecode;
+	llvm::raw_fd_ostream outputFile(path, ecode);
+	if (ecode)
+	{
+		llvm::errs() << path << ": " << ecode.message() << "\n";
+		return false;
+	}
+	outputFile << contents;
+	return true;
+}
+
+/**
+ * @return The globals `function` references, directly or through
+ * constant expressions, or None if it takes the address of a block.
+ */
+static llvm::Optional<std::vector<llvm::GlobalValue *>>
+referencedGlobals(const llvm::Function &function)
+{
+	std::vector<llvm::GlobalValue *> globals;
+	std::stack<const llvm::Value *> pending;
+	std::unordered_set<const llvm::Value *> seen;
+	for (const auto &instruction : llvm::instructions(function))
+	{
+		for (const auto &operand : instruction.operands())
+		{
+			pending.push(operand);
+		}
+	}
+	while (!pending.empty())
+	{
+		auto value = pending.top();
+		pending.pop();
+		auto constant = llvm::dyn_cast<llvm::Constant>(value);
+		if (!constant || !seen.insert(constant).second)
+		{
+			continue;
+		}
+		if (llvm::isa<llvm::BlockAddress>(constant))
+		{
+			return llvm::None;
+		}
+		if (auto global = llvm::dyn_cast<llvm::GlobalValue>(constant))
+		{
+			globals.push_back(const_cast<llvm::GlobalValue *>(global));
+			continue;
+		}
+		for (const auto &operand : constant->operands())
+		{
+			pending.push(operand);
+		}
+	}
+	return globals;
+}
+
+/**
+ * @return Whether --clone-leaves copies `function` into the modules
+ * calling it: a definition of at most `maxSize` instructions, which
+ * calls nothing but intrinsics, has no side effects and only references
+ * functions and variables other modules can reach, as aliases and ifuncs
+ * cannot be declared as they are.
+ */
+static bool isCloneableLeaf(const llvm::Function &function, unsigned maxSize)
+{
+	if (maxSize == 0 || function.isDeclaration() || function.isVarArg() ||
+		function.getName() == "main" || function.hasPersonalityFn() ||
+		function.hasFnAttribute(llvm::Attribute::NoInline) ||
+		function.hasFnAttribute(llvm::Attribute::OptimizeNone) ||
+		function.getInstructionCount() > maxSize)
+	{
+		return false;
+	}
+	for (const auto &instruction : llvm::instructions(function))
+	{
+		auto call = llvm::dyn_cast<llvm::CallBase>(&instruction);
+		if (instruction.mayHaveSideEffects() ||
+			(call && (!call->getCalledFunction() || !call->getCalledFunction()->isIntrinsic())))
+		{
+			return false;
+		}
+	}
+	auto globals = referencedGlobals(function);
+	return globals &&
+		   std::none_of(globals->begin(), globals->end(),
+						[](const llvm::GlobalValue *global)
+						{
+							return !llvm::isa<llvm::Function, llvm::GlobalVariable>(global) ||
+								   global->hasLocalLinkage() || global->hasHiddenVisibility();
+						});
+}
+
+/**
+ * Print what a reference to `value` turns into once it is extracted:
+ * an external declaration, so only its signature matters.
+ */
+static void printDeclaration(llvm::raw_ostream &stream, const llvm::GlobalValue &value)
+{
+	stream << "declare " << value.getName() << ' ' << value.getLinkage() << ' '
+		   << value.getVisibility() << ' ' << value.getThreadLocalMode() << ' '
+		   << value.getAddressSpace() << ' ';
+	value.getValueType()->print(stream);
+
+	if (auto globalVariable = llvm::dyn_cast<llvm::GlobalVariable>(&value))
+	{
+		stream << ' ' << globalVariable->isConstant() << ' '
+			   << globalVariable->getAlign().valueOrOne().value();
+	}
+	else if (auto function = llvm::dyn_cast<llvm::Function>(&value))
+	{
+		const auto attributes = function->getAttributes();
+		stream << ' ' << function->getCallingConv() << ' '
+			   << attributes.getAsString(llvm::AttributeList::FunctionIndex) << ' '
+			   << attributes.getAsString(llvm::AttributeList::ReturnIndex);
+		for (unsigned argument = 0; argument < function->arg_size(); argument++)
+		{
+			stream << ' '
+				   << attributes.getAsString(llvm::AttributeList::FirstArgIndex + argument);
+		}
+	}
+	stream << '\n';
+}
+
+/**
+ * Compute a stable hash of everything that ends up in the module
+ * extracted for `values`, without extracting it.
+ *
+ * It covers the module level properties copied into every split
+ * module, the printed definitions of the values, the signatures of the
+ * globals and functions they reference (which become declarations) and
+ * the contents of all of the metadata they reach. It may change when the
+ * extracted module does not (metadata numbering, for example), but not
+ * the other way around.
+ *
+ * The functions are reached differently with --call-tables and
+ * --lazy-stubs depending on whether the input defines them and on
+ * whether their module is loaded on demand, so that is covered too.
+ *
+ * @param options The options changing how the module is extracted.
+ * @param definedFunctions The functions the input defines.
+ * @param lazyLibraries The functions loaded on demand, see addLazyStubs.
+ * @return The hash as a hexadecimal string.
+ */
+std::string hashExtraction(const llvm::Module &module,
+						   const std::vector<llvm::GlobalValue *> &values, const Options &options,
+						   const std::unordered_set<std::string> &definedFunctions,
+						   const std::unordered_map<std::string, std::string> &lazyLibraries)
+{
+	std::unordered_set<const llvm::GlobalValue *> selected(values.begin(), values.end());
+	std::unordered_set<const llvm::Value *> seenValues;
+	std::unordered_set<const llvm::Metadata *> seenMetadata;
+	std::stack<const llvm::Value *> pendingValues;
+	std::stack<const llvm::Metadata *> pendingMetadata;
+	llvm::SmallVector<std::pair<unsigned, llvm::MDNode *>, 4> attachments;
+
+	std::string text;
+	llvm::raw_string_ostream stream(text);
+	llvm::ModuleSlotTracker slots(&module, false);
+
+	stream << manifestVersion << '\n'
+		   << (options.compact ? (options.stripDebug ? "compact strip-debug\n" : "compact\n") : "")
+		   << (options.callTables ? "call-tables\n" : "")
+		   << (options.lazyStubs ? "lazy-stubs\n" : "")
+		   << (options.leafCloneSize > 0
+				   ? "clone-leaves " + std::to_string(options.leafCloneSize) + "\n"
+				   : "")
+		   << module.getTargetTriple() << '\n'
+		   << module.getDataLayoutStr() << '\n';
+
+	for (const auto &namedMetadata : module.named_metadata())
+	{
+		stream << namedMetadata.getName() << '\n';
+		for (const auto node : namedMetadata.operands())
+		{
+			pendingMetadata.push(node);
+		}
+	}
+
+	for (const auto value : values)
+	{
+		if (auto function = llvm::dyn_cast<llvm::Function>(value))
+		{
+			slots.incorporateFunction(*function);
+			for (const auto &instruction : llvm::instructions(*function))
+			{
+				for (const auto &operand : instruction.operands())
+				{
+					if (auto metadata = llvm::dyn_cast<llvm::MetadataAsValue>(operand))
+					{
+						pendingMetadata.push(metadata->getMetadata());
+					}
+					else
+					{
+						pendingValues.push(operand);
+					}
+				}
+				attachments.clear();
+				instruction.getAllMetadata(attachments);
+				for (const auto &[kind, node] : attachments)
+				{
+					pendingMetadata.push(node);
+				}
+			}
+		}
+
+		for (const auto &operand : value->operands())
+		{
+			pendingValues.push(operand);
+		}
+
+		if (auto globalObject = llvm::dyn_cast<llvm::GlobalObject>(value))
+		{
+			attachments.clear();
+			globalObject->getAllMetadata(attachments);
+			for (const auto &[kind, node] : attachments)
+			{
+				pendingMetadata.push(node);
+			}
+		}
+
+		value->print(stream, slots);
+		stream << '\n' << (lazyLibraries.count(value->getName().str()) != 0 ? "lazy\n" : "");
+	}
+
+	while (pendingValues.size() > 0)
+	{
+		auto value = pendingValues.top();
+		pendingValues.pop();
+
+		auto constant = llvm::dyn_cast<llvm::Constant>(value);
+		if (!constant || !seenValues.insert(constant).second)
+		{
+			continue;
+		}
+
+		if (auto globalValue = llvm::dyn_cast<llvm::GlobalValue>(constant))
+		{
+			if (selected.find(globalValue) == selected.end())
+			{
+				printDeclaration(stream, *globalValue);
+				const auto name = globalValue->getName().str();
+				stream << (definedFunctions.count(name) != 0 ? "defined " : "")
+					   << (lazyLibraries.count(name) != 0 ? "lazy" : "") << '\n';
+			}
+			// The callers get a copy of the leaves, so their bodies matter.
+			auto function = llvm::dyn_cast<llvm::Function>(globalValue);
+			if (function && selected.find(function) == selected.end() &&
+				isCloneableLeaf(*function, options.leafCloneSize))
+			{
+				function->print(stream);
+				for (const auto &instruction : llvm::instructions(*function))
+				{
+					for (const auto &operand : instruction.operands())
+					{
+						pendingValues.push(operand);
+					}
+					attachments.clear();
+					instruction.getAllMetadata(attachments);
+					for (const auto &[kind, node] : attachments)
+					{
+						pendingMetadata.push(node);
+					}
+				}
+				if (auto subprogram = function->getSubprogram())
+				{
+					pendingMetadata.push(subprogram);
+				}
+			}
+			continue;
+		}
+
+		for (const auto &operand : constant->operands())
+		{
+			pendingValues.push(operand);
+		}
+	}
+
+	while (pendingMetadata.size() > 0)
+	{
+		auto metadata = pendingMetadata.top();
+		pendingMetadata.pop();
+
+		if (!metadata || !seenMetadata.insert(metadata).second)
+		{
+			continue;
+		}
+
+		metadata->print(stream, slots, &module);
+		stream << '\n';
+
+		if (auto node = llvm::dyn_cast<llvm::MDNode>(metadata))
+		{
+			for (const auto &operand : node->operands())
+			{
+				pendingMetadata.push(operand);
+			}
+		}
+	}
+
+	llvm::MD5 md5;
+	md5.update(stream.str());
+	llvm::MD5::MD5Result result;
+	md5.final(result);
+	return result.digest().str().str();
+}
+
+/**
+ * The manifest records, for every module written to the output
+ * directory, the hash of what it was extracted from (see hashExtraction)
+ * and the values it contains.
+ *
+ * Modules whose hash did not change since the previous run are neither
+ * extracted nor written again, and modules which are no longer produced
+ * are removed. The other files written next to the modules, such as the
+ * export lists, are recorded without a hash so that they are removed too
+ * when a later run does not produce them.
+ *
+ * With --archive, the modules are recorded under the name of the archive
+ * they are stored in (see moduleEntry), so that switching to or from it
+ * extracts every module again and removes the files of the other layout.
+ */
+class Manifest
+{
+  public:
+	Manifest(std::string directory, bool archived)
+		: directory(std::move(directory)), archived(archived)
+	{
+		std::ifstream input(path());
+		std::string line;
+		while (std::getline(input, line))
+		{
+			llvm::SmallVector<llvm::StringRef, 3> fields;
+			llvm::StringRef(line).split(fields, '\t');
+			if (fields.size() >= 2)
+			{
+				previous.emplace(fields[0].str(), fields[1].str());
+			}
+		}
+	}
+
+	/**
+	 * @return The entry recording the module `file`: its name, or the name
+	 * of the archive it is stored in followed by its own.
+	 */
+	std::string moduleEntry(const std::string &file) const
+	{
+		return archived ? archivePrefix + file : file;
+	}
+
+	/**
+	 * @return true if `file` was written by the previous run from
+	 * something with the same hash.
+	 */
+	bool isUnchanged(const std::string &file, const std::string &hash) const
+	{
+		auto found = previous.find(file);
+		return found != previous.end() && found->second == hash;
+	}
+
+	void record(const std::string &file, const std::string &hash,
+				const std::vector<llvm::GlobalValue *> &values)
+	{
+		std::stringstream line;
+		line << hash << "\t";
+		for (const auto value : values)
+		{
+			line << (value == values.front() ? "" : " ") << value->getName().str();
+		}
+
+		std::lock_guard<std::mutex> guard(lock);
+		current[file] = line.str();
+	}
+
+	void record(const std::string &file)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		current[file] = "-";
+	}
+
+	/**
+	 * Remove the files written by the previous run which were not
+	 * produced by this one, and save the new manifest.
+	 *
+	 * @return The number of removed files.
+	 */
+	size_t save()
+	{
+		size_t removed = 0;
+		for (const auto &[file, hash] : previous)
+		{
+			if (current.find(file) == current.end() &&
+				!llvm::StringRef(file).startswith(archivePrefix))
+			{
+				std::error_code ecode;
+				removed += std::filesystem::remove(directory + "/" + file, ecode);
+			}
+		}
+
+		std::string contents;
+		for (const auto &[file, line] : current)
+		{
+			contents += file + "\t" + line + "\n";
+		}
+		writeIfChanged(path(), contents);
+		return removed;
+	}
+
+  private:
+	static constexpr const char *archivePrefix = "split.archive:";
+
+	std::string directory;
+	bool archived;
+	std::unordered_map<std::string, std::string> previous;
+	std::map<std::string, std::string> current;
+	std::mutex lock;
+
+	std::string path() const
+	{
+		return directory + "/split.manifest";
+	}
+};
+
+/**
+ * Extract the given globals and functions into a module of their own.
+ *
+ * This mirrors what `llvm-extract --func=... --glob=...` does: the
+ * selected values keep their definitions, everything they reference is
+ * turned into an external declaration (see splitPartition::extract) and
+ * the result is cleaned up with the same passes llvm-extract runs before
+ * writing its output.
+ *
+ * Only the selected values and what they reference are visited, and the
+ * passes run on the extracted module, so the cost depends on the size of
+ * the extracted values and not on the size of the whole module.
+ *
+ * @param module The module the values are extracted from.
+ * @param values The globals and functions which keep their definitions.
+ * @return The extracted module, in the same context as `module`.
+ */
+std::unique_ptr<llvm::Module> extractModule(const llvm::Module &module,
+											const std::vector<llvm::GlobalValue *> &values)
+{
+	auto result = splitPartition::extract(module, values);
+
+	llvm::legacy::PassManager passes;
+	passes.add(llvm::createGlobalDCEPass());
+	passes.add(llvm::createStripDeadDebugInfoPass());
+	passes.add(llvm::createStripDeadPrototypesPass());
+	passes.run(*result);
+	return result;
+}
+
+// The named metadata --compact removes, which only records how the input
+// was compiled, in the comments of the object file. Any other named
+// metadata is kept, as it may change how the module is compiled or linked
+// (llvm.linker.options, llvm.dependent-libraries, ...).
+const std::unordered_set<std::string> compactNamedMetadata = {"llvm.ident", "llvm.commandline"};
+
+/**
+ * Remove what a split module does not need, as its fixed overhead
+ * dominates the size of modules with a single small function.
+ *
+ * The named metadata which is known not to affect code generation or
+ * linking is dropped, as are the local value names. The debug info is either
+ * dropped entirely (`stripDebug`) or reduced to what the definitions
+ * in the module reach: the lists of enums, retained types, imported
+ * entities and macros of the compile units are cleared, then whatever
+ * is not referenced anymore is removed.
+ */
+void compactModule(llvm::Module &module, bool stripDebug)
+{
+	std::vector<llvm::NamedMDNode *> irrelevant;
+	for (auto &namedMetadata : module.named_metadata())
+	{
+		if (compactNamedMetadata.find(namedMetadata.getName().str()) !=
+			compactNamedMetadata.end())
+		{
+			irrelevant.push_back(&namedMetadata);
+		}
+	}
+	for (auto namedMetadata : irrelevant)
+	{
+		module.eraseNamedMetadata(namedMetadata);
+	}
+
+	if (stripDebug)
+	{
+		llvm::StripDebugInfo(module);
+	}
+	else
+	{
+		for (auto compileUnit : module.debug_compile_units())
+		{
+			compileUnit->replaceEnumTypes(nullptr);
+			compileUnit->replaceRetainedTypes(nullptr);
+			compileUnit->replaceImportedEntities(nullptr);
+			compileUnit->replaceMacros(nullptr);
+		}
+	}
+
+	for (auto &function : module.functions())
+	{
+		for (auto &argument : function.args())
+		{
+			argument.setName("");
+		}
+		for (auto &basicBlock : function)
+		{
+			basicBlock.setName("");
+			for (auto &instruction : basicBlock)
+			{
+				instruction.setName("");
+			}
+		}
+	}
+
+	llvm::legacy::PassManager passes;
+	passes.add(llvm::createGlobalDCEPass());
+	passes.add(llvm::createStripDeadDebugInfoPass());
+	passes.add(llvm::createStripDeadPrototypesPass());
+	passes.run(module);
+}
+
+/**
+ * Redirect the calls `module` makes to the functions of
+ * `definedFunctions`, the functions of the input which other split
+ * modules define, through a table holding their addresses.
+ *
+ * The table is initialized with the addresses, so the dynamic linker
+ * fills it once, when the library is loaded, and every such call becomes
+ * a load and an indirect call, instead of a call through the PLT which
+ * binds lazily. The calls to the functions defined in `module` stay
+ * direct. The table is hidden and not constant, so that optimizing the
+ * module later does not fold the loads back into direct calls.
+ *
+ * @param tableName A name for the table unique among the split modules.
+ * @return The number of calls redirected.
+ */
+size_t addCallTables(llvm::Module &module,
+					 const std::unordered_set<std::string> &definedFunctions,
+					 const std::string &tableName)
+{
+	std::vector<llvm::CallBase *> calls;
+	std::vector<llvm::Function *> callees;
+	std::unordered_map<llvm::Function *, unsigned> slots;
+	for (auto &function : module.functions())
+	{
+		for (auto &instruction : llvm::instructions(function))
+		{
+			auto call = llvm::dyn_cast<llvm::CallBase>(&instruction);
+			if (!call || call->isMustTailCall() || llvm::isa<llvm::CallBrInst>(call))
+			{
+				continue;
+			}
+			auto callee = llvm::dyn_cast<llvm::Function>(call->getCalledOperand());
+			if (!callee || !callee->isDeclaration() || callee->isIntrinsic() ||
+				callee->getFunctionType() != call->getFunctionType())
+			{
+				continue;
+			}
+			if (definedFunctions.find(callee->getName().str()) == definedFunctions.end())
+			{
+				continue;
+			}
+			if (slots.emplace(callee, callees.size()).second)
+			{
+				callees.push_back(callee);
+			}
+			calls.push_back(call);
+		}
+	}
+	if (calls.empty())
+	{
+		return 0;
+	}
+
+	std::vector<llvm::Type *> types;
+	std::vector<llvm::Constant *> addresses;
+	for (auto callee : callees)
+	{
+		types.push_back(callee->getType());
+		addresses.push_back(callee);
+	}
+	auto tableType = llvm::StructType::get(module.getContext(), types);
+	auto table = new llvm::GlobalVariable(module, tableType, false,
+										  llvm::GlobalValue::ExternalLinkage,
+										  llvm::ConstantStruct::get(tableType, addresses),
+										  tableName);
+	table->setVisibility(llvm::GlobalValue::HiddenVisibility);
+	table->setDSOLocal(true);
+
+	for (auto call : calls)
+	{
+		auto callee = llvm::cast<llvm::Function>(call->getCalledOperand());
+		llvm::IRBuilder<> builder(call);
+		auto slot = builder.CreateStructGEP(tableType, table, slots[callee]);
+		call->setCalledOperand(builder.CreateLoad(callee->getType(), slot));
+	}
+	return calls.size();
+}
+
+/**
+ * The small leaf functions copied into a module by cloneLeafCallees.
+ */
+struct LeafClones
+{
+	std::vector<std::string> functions;
+	// The calls which went to another module before.
+	size_t calls = 0;
+	uint64_t instructions = 0;
+};
+
+/**
+ * Copy the small leaf functions (see isCloneableLeaf) which `module`
+ * calls from `source` into it, as internal functions the calls then go
+ * to, so that the optimizer can inline them as in the unsplit program.
+ * Other references, like function pointers, still use the function
+ * exported by its own module.
+ *
+ * @param maxSize The size of the largest leaf copied, see isCloneableLeaf.
+ */
+LeafClones cloneLeafCallees(llvm::Module &module, const llvm::Module &source, unsigned maxSize)
+{
+	LeafClones clones;
+	std::vector<llvm::Function *> declarations;
+	for (auto &function : module.functions())
+	{
+		if (function.isDeclaration() && !function.isIntrinsic())
+		{
+			declarations.push_back(&function);
+		}
+	}
+
+	for (auto declaration : declarations)
+	{
+		auto original = source.getFunction(declaration->getName());
+		if (!original || original->getFunctionType() != declaration->getFunctionType() ||
+			!isCloneableLeaf(*original, maxSize))
+		{
+			continue;
+		}
+		std::vector<llvm::CallBase *> calls;
+		for (auto user : declaration->users())
+		{
+			auto call = llvm::dyn_cast<llvm::CallBase>(user);
+			if (call && call->getCalledOperand() == declaration &&
+				call->getFunctionType() == declaration->getFunctionType())
+			{
+				calls.push_back(call);
+			}
+		}
+		if (calls.empty())
+		{
+			continue;
+		}
+
+		// What the leaf references is declared in `module` if it is not
+		// there yet.
+		llvm::ValueToValueMapTy map;
+		bool mapped = true;
+		const auto globals = referencedGlobals(*original);
+		for (auto global : *globals)
+		{
+			auto local = module.getNamedValue(global->getName());
+			if (!local)
+			{
+				if (auto function = llvm::dyn_cast<llvm::Function>(global))
+				{
+					auto copy = llvm::Function::Create(
+						function->getFunctionType(), llvm::GlobalValue::ExternalLinkage,
+						function->getAddressSpace(), function->getName(), &module);
+					copy->setCallingConv(function->getCallingConv());
+					copy->setAttributes(function->getAttributes());
+					local = copy;
+				}
+				else
+				{
+					local = new llvm::GlobalVariable(
+						module, global->getValueType(),
+						llvm::cast<llvm::GlobalVariable>(global)->isConstant(),
+						llvm::GlobalValue::ExternalLinkage, nullptr, global->getName(), nullptr,
+						global->getThreadLocalMode(), global->getAddressSpace());
+				}
+			}
+			if (local->getType() != global->getType())
+			{
+				mapped = false;
+				break;
+			}
+			map[global] = local;
+		}
+		if (!mapped)
+		{
+			continue;
+		}
+
+		auto clone = llvm::Function::Create(
+			declaration->getFunctionType(), llvm::GlobalValue::InternalLinkage,
+			declaration->getAddressSpace(), declaration->getName() + ".leaf", &module);
+		auto argument = clone->arg_begin();
+		for (const auto &originalArgument : original->args())
+		{
+			argument->setName(originalArgument.getName());
+			map[&originalArgument] = &*argument++;
+		}
+		// The compile unit of the leaf is the copy `module` already has,
+		// rather than a second one.
+		auto subprogram = original->getSubprogram();
+		if (auto compileUnits = module.getNamedMetadata("llvm.dbg.cu"); subprogram && compileUnits)
+		{
+			auto unit = subprogram->getUnit();
+			for (auto operand : compileUnits->operands())
+			{
+				auto existing = llvm::cast<llvm::DICompileUnit>(operand);
+				if (existing->getFile() == unit->getFile() &&
+					existing->getProducer() == unit->getProducer() &&
+					existing->getSourceLanguage() == unit->getSourceLanguage())
+				{
+					map.MD()[unit].reset(existing);
+					break;
+				}
+			}
+		}
+		llvm::SmallVector<llvm::ReturnInst *, 4> returns;
+		llvm::CloneFunctionInto(clone, original, map,
+								llvm::CloneFunctionChangeType::DifferentModule, returns);
+		// Cloning into another module creates llvm.dbg.cu, even when the
+		// leaf has no debug info.
+		auto compileUnits = module.getNamedMetadata("llvm.dbg.cu");
+		if (compileUnits && compileUnits->getNumOperands() == 0)
+		{
+			module.eraseNamedMetadata(compileUnits);
+		}
+		clone->setLinkage(llvm::GlobalValue::InternalLinkage);
+		clone->setVisibility(llvm::GlobalValue::DefaultVisibility);
+		clone->setComdat(nullptr);
+
+		for (auto call : calls)
+		{
+			call->setCalledFunction(clone);
+		}
+		if (declaration->use_empty())
+		{
+			declaration->eraseFromParent();
+		}
+		clones.functions.push_back(original->getName().str());
+		clones.calls += calls.size();
+		clones.instructions += clone->getInstructionCount();
+	}
+	return clones;
+}
+
+/**
+ * Make `module` reach the functions of `lazyLibraries` (the name of a
+ * function and of the module defining it) through their lazy stubs: a
+ * call loads the current binding of the function from
+ * `__split_lazy.<name>`, and any other reference, like a function
+ * pointer in a table, uses `__split_stub.<name>`. Both are defined in
+ * the stubs module built by `buildLazyStubs`.
+ *
+ * The module defining such a function calls it directly, but takes its
+ * address as `__split_stub.<name>` too, so that the address of a function
+ * is the same in every module and function pointers can be compared.
+ *
+ * Another thread may bind the function at any time, so the binding is
+ * loaded atomically, pairing with the release store of `__split_resolve`.
+ */
+void addLazyStubs(llvm::Module &module,
+				  const std::unordered_map<std::string, std::string> &lazyLibraries)
+{
+	std::vector<llvm::Function *> lazyFunctions;
+	std::vector<llvm::Function *> lazyDefinitions;
+	for (auto &function : module.functions())
+	{
+		if (lazyLibraries.find(function.getName().str()) != lazyLibraries.end())
+		{
+			(function.isDeclaration() ? lazyFunctions : lazyDefinitions).push_back(&function);
+		}
+	}
+
+	for (auto function : lazyDefinitions)
+	{
+		auto isAddress = [](const llvm::Use &use)
+		{
+			auto call = llvm::dyn_cast<llvm::CallBase>(use.getUser());
+			return !call || !call->isCallee(&use);
+		};
+		if (std::any_of(function->use_begin(), function->use_end(), isAddress))
+		{
+			auto stub = module.getOrInsertFunction("__split_stub." + function->getName().str(),
+												   function->getFunctionType());
+			function->replaceUsesWithIf(stub.getCallee(), isAddress);
+		}
+	}
+
+	for (auto function : lazyFunctions)
+	{
+		const auto name = function->getName().str();
+		auto binding = module.getOrInsertGlobal("__split_lazy." + name, function->getType());
+
+		std::vector<llvm::CallBase *> calls;
+		for (auto user : function->users())
+		{
+			auto call = llvm::dyn_cast<llvm::CallBase>(user);
+			if (call && call->getCalledOperand() == function &&
+				call->getFunctionType() == function->getFunctionType())
+			{
+				calls.push_back(call);
+			}
+		}
+		const auto alignment = module.getDataLayout().getPointerABIAlignment(
+			function->getType()->getPointerAddressSpace());
+		for (auto call : calls)
+		{
+			llvm::IRBuilder<> builder(call);
+			auto load = builder.CreateAlignedLoad(function->getType(), binding, alignment);
+			load->setAtomic(llvm::AtomicOrdering::Acquire);
+			call->setCalledOperand(load);
+		}
+
+		if (!function->use_empty())
+		{
+			auto stub = llvm::Function::Create(function->getFunctionType(),
+											   llvm::GlobalValue::ExternalLinkage,
+											   "__split_stub." + name, module);
+			function->replaceAllUsesWith(stub);
+		}
+		function->eraseFromParent();
+	}
+}
+
+/**
+ * Build the module holding, for every function of `lazyLibraries`, its
+ * binding `__split_lazy.<name>` and its stub `__split_stub.<name>`.
+ *
+ * The binding first points at the stub. When called, the stub loads the
+ * library of the function with dlopen, finds the function with dlsym,
+ * stores it in the binding and tail calls it with the same arguments.
+ * After that, the calls through the binding go to the function directly,
+ * and those through the stub (as a function pointer) only cost a load
+ * and a compare more.
+ *
+ * The module goes into the executable, so that dlopen finds the
+ * libraries with its run path.
+ */
+std::unique_ptr<llvm::Module>
+buildLazyStubs(const llvm::Module &source,
+			   const std::unordered_map<std::string, std::string> &lazyLibraries)
+{
+	auto &context = source.getContext();
+	auto module = std::make_unique<llvm::Module>("lazy.stubs", context);
+	module->setDataLayout(source.getDataLayout());
+	module->setTargetTriple(source.getTargetTriple());
+
+	auto bytePointer = llvm::Type::getInt8PtrTy(context);
+	auto int32 = llvm::Type::getInt32Ty(context);
+	auto dlopen = module->getOrInsertFunction(
+		"dlopen", llvm::FunctionType::get(bytePointer, {bytePointer, int32}, false));
+	auto dlsym = module->getOrInsertFunction(
+		"dlsym", llvm::FunctionType::get(bytePointer, {bytePointer, bytePointer}, false));
+	auto dlerror =
+		module->getOrInsertFunction("dlerror", llvm::FunctionType::get(bytePointer, false));
+	auto dprintf = module->getOrInsertFunction(
+		"dprintf", llvm::FunctionType::get(int32, {int32, bytePointer}, true));
+	auto abort = module->getOrInsertFunction(
+		"abort", llvm::FunctionType::get(llvm::Type::getVoidTy(context), false));
+
+	// i8* __split_resolve(i8** binding, i8* library, i8* symbol)
+	auto resolve = llvm::Function::Create(
+		llvm::FunctionType::get(bytePointer,
+								{bytePointer->getPointerTo(), bytePointer, bytePointer}, false),
+		llvm::GlobalValue::InternalLinkage, "__split_resolve", *module);
+	{
+		auto entry = llvm::BasicBlock::Create(context, "", resolve);
+		auto loaded = llvm::BasicBlock::Create(context, "", resolve);
+		auto failed = llvm::BasicBlock::Create(context, "", resolve);
+		auto found = llvm::BasicBlock::Create(context, "", resolve);
+		llvm::IRBuilder<> builder(entry);
+		// RTLD_LAZY is 1 on Linux and on the BSDs.
+		auto handle = builder.CreateCall(dlopen, {resolve->getArg(1), builder.getInt32(1)});
+		builder.CreateCondBr(builder.CreateIsNull(handle), failed, loaded);
+
+		builder.SetInsertPoint(loaded);
+		auto address = builder.CreateCall(dlsym, {handle, resolve->getArg(2)});
+		builder.CreateCondBr(builder.CreateIsNull(address), failed, found);
+
+		builder.SetInsertPoint(failed);
+		builder.CreateCall(dprintf, {builder.getInt32(2),
+									 builder.CreateGlobalStringPtr("lazy stub: %s\n"),
+									 builder.CreateCall(dlerror)});
+		builder.CreateCall(abort);
+		builder.CreateUnreachable();
+
+		builder.SetInsertPoint(found);
+		auto store = builder.CreateStore(address, resolve->getArg(0));
+		store->setAtomic(llvm::AtomicOrdering::Release);
+		store->setAlignment(source.getDataLayout().getPointerABIAlignment(0));
+		builder.CreateRet(address);
+	}
+
+	std::map<std::string, std::string> sorted(lazyLibraries.begin(), lazyLibraries.end());
+	for (const auto &[name, library] : sorted)
+	{
+		auto function = source.getFunction(name);
+		auto type = function->getFunctionType();
+		// The tail call must pass the arguments the same way, so the stub
+		// has the parameter attributes of the function, but none of its
+		// function attributes.
+		const auto attributes = function->getAttributes().removeFnAttributes(context);
+		auto stub = llvm::Function::Create(type, llvm::GlobalValue::ExternalLinkage,
+										   "__split_stub." + name, *module);
+		stub->setCallingConv(function->getCallingConv());
+		stub->setAttributes(attributes);
+		auto binding = new llvm::GlobalVariable(*module, stub->getType(), false,
+												llvm::GlobalValue::ExternalLinkage, stub,
+												"__split_lazy." + name);
+		const auto alignment = source.getDataLayout().getPointerABIAlignment(
+			stub->getType()->getPointerAddressSpace());
+		binding->setAlignment(alignment);
+
+		auto entry = llvm::BasicBlock::Create(context, "", stub);
+		auto unbound = llvm::BasicBlock::Create(context, "", stub);
+		auto call = llvm::BasicBlock::Create(context, "", stub);
+		llvm::IRBuilder<> builder(entry);
+		auto current = builder.CreateAlignedLoad(stub->getType(), binding, alignment);
+		current->setAtomic(llvm::AtomicOrdering::Acquire);
+		builder.CreateCondBr(builder.CreateICmpEQ(current, stub), unbound, call);
+
+		builder.SetInsertPoint(unbound);
+		auto resolved = builder.CreateCall(
+			resolve,
+			{builder.CreateBitCast(binding, bytePointer->getPointerTo()),
+			 builder.CreateGlobalStringPtr("lib_" + library + ".so"),
+			 builder.CreateGlobalStringPtr(name)});
+		auto bound = builder.CreateBitCast(resolved, stub->getType());
+		builder.CreateBr(call);
+
+		builder.SetInsertPoint(call);
+		auto target = builder.CreatePHI(stub->getType(), 2);
+		target->addIncoming(current, entry);
+		target->addIncoming(bound, unbound);
+		std::vector<llvm::Value *> arguments;
+		for (auto &argument : stub->args())
+		{
+			arguments.push_back(&argument);
+		}
+		auto forward = builder.CreateCall(type, target, arguments);
+		forward->setCallingConv(function->getCallingConv());
+		forward->setAttributes(attributes);
+		forward->setTailCallKind(llvm::CallInst::TCK_MustTail);
+		if (type->getReturnType()->isVoidTy())
+		{
+			builder.CreateRetVoid();
+		}
+		else
+		{
+			builder.CreateRet(forward);
+		}
+	}
+	return module;
+}
+
+/**
+ * The symbols a split module defines and the ones it takes from other
+ * modules, from which the export lists are computed.
+ */
+struct ModuleSymbols
+{
+	std::vector<std::string> definitions;
+	std::vector<std::string> imports;
+};
+
+ModuleSymbols collectSymbols(const llvm::Module &module)
+{
+	ModuleSymbols symbols;
+	for (const auto &value : module.global_values())
+	{
+		if (value.hasLocalLinkage() || value.getName().startswith("llvm."))
+		{
+			continue;
+		}
+		(value.isDeclaration() ? symbols.imports : symbols.definitions)
+			.push_back(value.getName().str());
+	}
+	return symbols;
+}
+
+/**
+ * @return The symbols of a module written before, read without loading
+ * any of its function bodies.
+ */
+llvm::Optional<ModuleSymbols> readSymbols(llvm::StringRef bitcode, const std::string &name)
+{
+	llvm::LLVMContext context;
+	auto module = llvm::getLazyBitcodeModule(llvm::MemoryBufferRef(bitcode, name), context);
+	if (!module)
+	{
+		llvm::consumeError(module.takeError());
+		return llvm::None;
+	}
+	return collectSymbols(**module);
+}
+
+/**
+ * Write the export lists of the split modules: a version script for
+ * every library, exporting the symbols it defines which another module
+ * imports and making everything else local, and a dynamic list of the
+ * symbols the executable (`main` and the lazy stubs) must export.
+ *
+ * The files are recorded in `manifest`, so that the ones of modules which
+ * are gone, or all of them once --export-lists is not given anymore, are
+ * removed instead of being picked up by the link. No dynamic list is
+ * written when the executable exports nothing, as GNU ld rejects an
+ * empty one.
+ *
+ * @param directory Where the files are written.
+ * @param changed Filled with the libraries whose version script changed.
+ * @return The number of symbols exported, or None if a file could not be
+ * written.
+ */
+llvm::Optional<size_t> writeExportLists(const std::string &directory,
+										const std::map<std::string, ModuleSymbols> &modules,
+										Manifest &manifest,
+										std::unordered_set<std::string> &changed)
+{
+	bool written = true;
+	std::unordered_set<std::string> imported;
+	for (const auto &[name, symbols] : modules)
+	{
+		imported.insert(symbols.imports.begin(), symbols.imports.end());
+	}
+
+	size_t exported = 0;
+	std::vector<std::string> executableExports;
+	for (const auto &[name, symbols] : modules)
+	{
+		std::vector<std::string> exports;
+		for (const auto &definition : symbols.definitions)
+		{
+			if (imported.find(definition) != imported.end())
+			{
+				exports.push_back(definition);
+			}
+		}
+		std::sort(exports.begin(), exports.end());
+		exported += exports.size();
+
+		if (name == "main" || name == "lazy.stubs")
+		{
+			executableExports.insert(executableExports.end(), exports.begin(), exports.end());
+			continue;
+		}
+		std::string script = "{\n";
+		if (!exports.empty())
+		{
+			script += "  global:\n";
+			for (const auto &symbol : exports)
+			{
+				script += "    " + symbol + ";\n";
+			}
+		}
+		script += "  local: *;\n};\n";
+		const auto scriptFile = "_" + name + ".exports";
+		bool scriptChanged = false;
+		written &= writeIfChanged(directory + "/" + scriptFile, script, &scriptChanged);
+		manifest.record(scriptFile);
+		if (scriptChanged)
+		{
+			changed.insert(name);
+		}
+	}
+
+	if (!executableExports.empty())
+	{
+		std::sort(executableExports.begin(), executableExports.end());
+		std::string list = "{\n";
+		for (const auto &symbol : executableExports)
+		{
+			list += "  " + symbol + ";\n";
+		}
+		list += "};\n";
+		written &= writeIfChanged(directory + "/_main.dynamic-list", list);
+		manifest.record("_main.dynamic-list");
+	}
+	return written ? llvm::Optional<size_t>(exported) : llvm::None;
+}
+
+/**
+ * @return The size of `module` once written as bitcode.
+ */
+size_t bitcodeSize(const llvm::Module &module)
+{
+	llvm::SmallVector<char, 0> bitcode;
+	llvm::raw_svector_ostream bitcodeStream(bitcode);
+	llvm::WriteBitcodeToFile(module, bitcodeStream);
+	return bitcode.size();
+}
+
+/**
+ * Write `module` as bitcode to `outputPath`, if its contents changed.
+ *
+ * @return false if the output file could not be written.
+ */
+bool writeBitcode(const llvm::Module &module, const std::string &outputPath)
+{
+	llvm::SmallVector<char, 0> bitcode;
+	llvm::raw_svector_ostream bitcodeStream(bitcode);
+	llvm::WriteBitcodeToFile(module, bitcodeStream);
+	return writeIfChanged(outputPath, llvm::StringRef(bitcode.data(), bitcode.size()));
+}
+
+/**
+ * Create a TargetMachine which generates position independent code
+ * (the split modules become shared libraries) for the target of
+ * `module`. The target ABI is taken from the `target-abi` module flag,
+ * which is how CHERI purecap modules record it.
+ *
+ * @param codegenOptLevel The optimization level, from 0 to 3.
+ * @return nullptr if the target is not available.
+ */
+std::unique_ptr<llvm::TargetMachine> createTargetMachine(const llvm::Module &module,
+														 unsigned codegenOptLevel)
+{
+	auto triple = module.getTargetTriple();
+	if (triple.empty())
+	{
+		triple = llvm::sys::getDefaultTargetTriple();
+	}
+
+	std::string error;
+	auto target = llvm::TargetRegistry::lookupTarget(triple, error);
+	if (!target)
+	{
+		std::lock_guard<std::mutex> guard(outputMutex);
+		llvm::errs() << triple << ": " << error << "\n";
+		return nullptr;
+	}
+
+	llvm::TargetOptions options;
+	if (auto abi = llvm::dyn_cast_or_null<llvm::MDString>(module.getModuleFlag("target-abi")))
+	{
+		options.MCOptions.ABIName = abi->getString().str();
+	}
+
+	auto optLevel = static_cast<llvm::CodeGenOpt::Level>(std::min(codegenOptLevel, 3u));
+	return std::unique_ptr<llvm::TargetMachine>(target->createTargetMachine(
+		triple, "", "", options, llvm::Reloc::PIC_, llvm::None, optLevel));
+}
+
+/**
+ * Generate an object file for `module` and write it to `outputPath`,
+ * if its contents changed. The CPU and features are taken from the
+ * attributes of the functions, as for any other bitcode.
+ *
+ * @param changed If not null, set to whether the object file changed.
+ * @return false if the object file could not be generated or written.
+ */
+bool writeObject(llvm::TargetMachine &targetMachine, llvm::Module &module,
+				 const std::string &outputPath, bool *changed = nullptr)
+{
+	if (module.getDataLayout().isDefault())
+	{
+		module.setDataLayout(targetMachine.createDataLayout());
+	}
+
+	llvm::SmallVector<char, 0> object;
+	llvm::raw_svector_ostream objectStream(object);
+	llvm::legacy::PassManager passes;
+	if (targetMachine.addPassesToEmitFile(passes, objectStream, nullptr, llvm::CGFT_ObjectFile))
+	{
+		std::lock_guard<std::mutex> guard(outputMutex);
+		llvm::errs() << outputPath << ": the target cannot emit object files\n";
+		return false;
+	}
+	passes.run(module);
+	return writeIfChanged(outputPath, llvm::StringRef(object.data(), object.size()), changed);
+}
+
+/**
+ * Link the object file `objectPath` into the shared library `outputPath`
+ * with the linker driver and flags of `options`, restricting the symbols it
+ * exports with the version script `versionScript` if not empty.
+ *
+ * @return false if the linker could not be run or failed.
+ */
+bool linkSharedLibrary(const Options &options, const std::string &objectPath,
+					   const std::string &outputPath, const std::string &versionScript = "")
+{
+	auto program = llvm::sys::findProgramByName(options.linker);
+	if (!program)
+	{
+		std::lock_guard<std::mutex> guard(outputMutex);
+		llvm::errs() << options.linker << ": " << program.getError().message() << "\n";
+		return false;
+	}
+
+	std::vector<llvm::StringRef> arguments = {*program};
+	for (const auto &flag : options.linkerFlags)
+	{
+		arguments.push_back(flag);
+	}
+	arguments.insert(arguments.end(), {"-shared", "-fPIC", objectPath, "-o", outputPath});
+	const auto scriptFlag = "-Wl,--version-script=" + versionScript;
+	if (!versionScript.empty())
+	{
+		arguments.push_back(scriptFlag);
+	}
+
+	std::string error;
+	if (llvm::sys::ExecuteAndWait(*program, arguments, llvm::None, {}, 0, 0, &error) != 0)
+	{
+		std::lock_guard<std::mutex> guard(outputMutex);
+		llvm::errs() << outputPath << ": linking failed " << error << "\n";
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Function entry counts and call edge counts from a profile of the
+ * program, indexed by function name.
+ */
+struct CallProfile
+{
+	std::unordered_map<std::string, uint64_t> entryCounts;
+	std::map<std::pair<std::string, std::string>, uint64_t> callCounts;
+
+	bool empty() const
+	{
+		return entryCounts.empty() && callCounts.empty();
+	}
+
+	/**
+	 * Read the profile metadata already in the module: the entry counts
+	 * of the functions and the weights of the direct call sites, as
+	 * attached by `clang -fprofile-instr-use` or `-fprofile-sample-use`.
+	 */
+	void readMetadata(const llvm::Module &module)
+	{
+		for (const auto &function : module.functions())
+		{
+			if (auto count = function.getEntryCount())
+			{
+				entryCounts[function.getName().str()] = count->getCount();
+			}
+
+			for (const auto &instruction : llvm::instructions(function))
+			{
+				auto call = llvm::dyn_cast<llvm::CallBase>(&instruction);
+				uint64_t weight;
+				if (call && call->getCalledFunction() && call->extractProfTotalWeight(weight))
+				{
+					auto callee = call->getCalledFunction()->getName().str();
+					callCounts[{function.getName().str(), callee}] += weight;
+				}
+			}
+		}
+	}
+
+	/**
+	 * Read a count file, where every line is either `<function> <entry count>`
+	 * or `<caller> <callee> <call count>`. Counts in the file replace the
+	 * ones from the metadata. Empty lines and lines starting with `#` are
+	 * ignored.
+	 *
+	 * @return false if the file could not be read or is malformed.
+	 */
+	bool readFile(const std::string &path)
+	{
+		std::ifstream input(path);
+		if (!input)
+		{
+			llvm::errs() << path << ": could not open the profile\n";
+			return false;
+		}
+
+		std::string line;
+		for (unsigned number = 1; std::getline(input, line); number++)
+		{
+			llvm::SmallVector<llvm::StringRef, 3> fields;
+			llvm::StringRef(line).split(fields, ' ', -1, false);
+			if (fields.empty() || fields[0].startswith("#"))
+			{
+				continue;
+			}
+
+			uint64_t count;
+			if (fields.size() < 2 || fields.size() > 3 || fields.back().getAsInteger(10, count))
+			{
+				llvm::errs() << path << ":" << number << ": expected '<function> <count>' or "
+							 << "'<caller> <callee> <count>'\n";
+				return false;
+			}
+
+			if (fields.size() == 2)
+			{
+				entryCounts[fields[0].str()] = count;
+			}
+			else
+			{
+				callCounts[{fields[0].str(), fields[1].str()}] = count;
+			}
+		}
+		return true;
+	}
+};
+
+/**
+ * Groups the defined functions of a module into partitions, so that as
+ * few calls as possible cross from one partition to another.
+ *
+ * The call graph is built once. Every strongly connected component
+ * (mutually recursive functions) is kept in a single partition, then
+ * the components are merged greedily along the heaviest call edges as
+ * long as the merged partition stays under the size limit. The weight
+ * of an edge is the number of call sites, or the number of calls made
+ * when a profile is used.
+ */
+class CallGraphPartitioner
+{
+  public:
+	explicit CallGraphPartitioner(llvm::Module &module)
+	{
+		for (auto &function : module.functions())
+		{
+			indices.emplace(&function, functions.size());
+			functions.push_back(&function);
+			sizes.push_back(function.isDeclaration() ? 0 : function.getInstructionCount());
+		}
+
+		llvm::CallGraph callGraph(module);
+		parents.resize(functions.size());
+		for (unsigned index = 0; index < functions.size(); index++)
+		{
+			parents[index] = index;
+		}
+
+		for (auto scc = llvm::scc_begin(&callGraph); !scc.isAtEnd(); ++scc)
+		{
+			llvm::Optional<unsigned> first;
+			for (auto node : *scc)
+			{
+				if (auto function = node->getFunction(); function && !function->isDeclaration())
+				{
+					if (first)
+					{
+						merge(*first, indices[function]);
+					}
+					else
+					{
+						first = indices[function];
+					}
+				}
+			}
+		}
+
+		for (auto &[function, node] : callGraph)
+		{
+			if (!function || function->isDeclaration())
+			{
+				continue;
+			}
+			for (const auto &[callSite, callee] : *node)
+			{
+				auto calledFunction = callee->getFunction();
+				if (calledFunction && !calledFunction->isDeclaration() &&
+					calledFunction != function)
+				{
+					calls[{indices[function], indices[calledFunction]}]++;
+				}
+			}
+		}
+		weights = calls;
+	}
+
+	/**
+	 * Weigh the call edges with the number of calls made according to
+	 * `profile` instead of the number of call sites.
+	 *
+	 * Call edges without a count in the profile, but whose caller and callee
+	 * both have an entry count, are estimated to be taken as often as the
+	 * less frequently entered of the two.
+	 *
+	 * Only the hot edges, the most frequent ones which together make up
+	 * `hotFraction` of all the calls, are used to group functions. Every
+	 * function which is not part of a hot edge is considered cold and
+	 * is left in a module on its own.
+	 *
+	 * @return The number of hot call edges.
+	 */
+	size_t useProfile(const CallProfile &profile, double hotFraction)
+	{
+		std::unordered_map<std::string, unsigned> byName;
+		for (unsigned index = 0; index < functions.size(); index++)
+		{
+			if (!functions[index]->isDeclaration())
+			{
+				byName.emplace(functions[index]->getName().str(), index);
+			}
+		}
+
+		std::map<std::pair<unsigned, unsigned>, uint64_t> profiled;
+		for (const auto &[edge, count] : profile.callCounts)
+		{
+			auto caller = byName.find(edge.first);
+			auto callee = byName.find(edge.second);
+			if (caller != byName.end() && callee != byName.end() &&
+				caller->second != callee->second)
+			{
+				profiled[{caller->second, callee->second}] += count;
+			}
+		}
+
+		for (const auto &[edge, sites] : calls)
+		{
+			auto caller = profile.entryCounts.find(functions[edge.first]->getName().str());
+			auto callee = profile.entryCounts.find(functions[edge.second]->getName().str());
+			if (profiled.find(edge) == profiled.end() && caller != profile.entryCounts.end() &&
+				callee != profile.entryCounts.end())
+			{
+				profiled[edge] = std::min(caller->second, callee->second);
+			}
+		}
+
+		calls.clear();
+		uint64_t total = 0;
+		for (const auto &[edge, count] : profiled)
+		{
+			if (count > 0)
+			{
+				calls[edge] = count;
+				total += count;
+			}
+		}
+
+		std::vector<uint64_t> counts;
+		for (const auto &[edge, count] : calls)
+		{
+			counts.push_back(count);
+		}
+		std::sort(counts.rbegin(), counts.rend());
+
+		uint64_t cutoff = std::numeric_limits<uint64_t>::max();
+		uint64_t covered = 0;
+		for (auto count : counts)
+		{
+			if (covered >= hotFraction * total)
+			{
+				break;
+			}
+			covered += count;
+			cutoff = count;
+		}
+
+		weights.clear();
+		hot.assign(functions.size(), false);
+		for (const auto &[edge, count] : calls)
+		{
+			if (count >= cutoff)
+			{
+				weights[edge] = count;
+				hot[edge.first] = true;
+				hot[edge.second] = true;
+			}
+		}
+		return weights.size();
+	}
+
+	/**
+	 * Assign every defined function to a partition.
+	 *
+	 * When a profile is used, the cold functions (the ones which are not
+	 * part of a hot edge, along with the functions they are mutually
+	 * recursive with) are left in partitions on their own and do not count
+	 * towards `count`: packing them with the hot functions would not save
+	 * any calls and would only make the hot partitions larger.
+	 *
+	 * @param count The maximum number of partitions of hot functions, or 0
+	 * for no limit.
+	 * @param maxSize The maximum number of instructions in a partition, or 0
+	 * to derive it from `count`. Functions which are mutually recursive are
+	 * never separated, even when that exceeds the limit.
+	 * @return The indices of the functions in each partition, in module order.
+	 */
+	std::vector<std::vector<size_t>> partition(unsigned count, uint64_t maxSize)
+	{
+		std::vector<uint64_t> clusterSizes(functions.size(), 0);
+		std::vector<bool> clusterHot(functions.size(), hot.empty());
+		for (unsigned index = 0; index < functions.size(); index++)
+		{
+			clusterSizes[find(index)] += sizes[index];
+			if (!hot.empty() && hot[index])
+			{
+				clusterHot[find(index)] = true;
+			}
+		}
+
+		uint64_t total = 0;
+		for (unsigned index = 0; index < functions.size(); index++)
+		{
+			if (clusterHot[index])
+			{
+				total += clusterSizes[index];
+			}
+		}
+		if (maxSize == 0 && count > 0)
+		{
+			maxSize = (total + count - 1) / count;
+		}
+
+		// The heaviest edges first, ties broken by position for a stable result.
+		std::vector<std::pair<std::pair<unsigned, unsigned>, uint64_t>> edges(weights.begin(),
+																			  weights.end());
+		std::stable_sort(edges.begin(), edges.end(),
+						 [](const auto &left, const auto &right)
+						 { return left.second > right.second; });
+
+		for (const auto &[edge, weight] : edges)
+		{
+			auto caller = find(edge.first);
+			auto callee = find(edge.second);
+			if (caller == callee ||
+				(maxSize > 0 && clusterSizes[caller] + clusterSizes[callee] > maxSize))
+			{
+				continue;
+			}
+			auto merged = merge(caller, callee);
+			clusterSizes[merged] = clusterSizes[caller] + clusterSizes[callee];
+			clusterHot[merged] = clusterHot[caller] || clusterHot[callee];
+		}
+
+		std::map<unsigned, std::vector<size_t>> clusters;
+		for (unsigned index = 0; index < functions.size(); index++)
+		{
+			if (!functions[index]->isDeclaration())
+			{
+				clusters[find(index)].push_back(index);
+			}
+		}
+
+		std::vector<std::vector<size_t>> result;
+		std::vector<std::vector<size_t>> cold;
+		for (auto &[root, members] : clusters)
+		{
+			(clusterHot[root] ? result : cold).push_back(std::move(members));
+		}
+
+		if (count > 0 && result.size() > count)
+		{
+			result = pack(std::move(result), count, maxSize);
+		}
+		result.insert(result.end(), std::make_move_iterator(cold.begin()),
+					  std::make_move_iterator(cold.end()));
+
+		std::sort(result.begin(), result.end());
+		return result;
+	}
+
+	/**
+	 * @return The number of call sites (or of profiled calls) whose caller
+	 * and callee are in different partitions.
+	 */
+	uint64_t crossingCalls(const std::vector<std::vector<size_t>> &partitions) const
+	{
+		std::vector<size_t> partitionOf(functions.size(), 0);
+		for (size_t partition = 0; partition < partitions.size(); partition++)
+		{
+			for (auto index : partitions[partition])
+			{
+				partitionOf[index] = partition;
+			}
+		}
+
+		uint64_t crossing = 0;
+		for (const auto &[edge, weight] : calls)
+		{
+			if (partitionOf[edge.first] != partitionOf[edge.second])
+			{
+				crossing += weight;
+			}
+		}
+		return crossing;
+	}
+
+	/**
+	 * @return The number of call sites (or of profiled calls) between
+	 * different functions, which is the number of calls crossing modules
+	 * when every function is on its own.
+	 */
+	uint64_t totalCalls() const
+	{
+		uint64_t total = 0;
+		for (const auto &[edge, weight] : calls)
+		{
+			total += weight;
+		}
+		return total;
+	}
+
+  private:
+	std::vector<llvm::Function *> functions;
+	std::unordered_map<const llvm::Function *, unsigned> indices;
+	std::vector<uint64_t> sizes;
+	// All of the call edges between defined functions, and the ones
+	// used for grouping them.
+	std::map<std::pair<unsigned, unsigned>, uint64_t> calls;
+	std::map<std::pair<unsigned, unsigned>, uint64_t> weights;
+	// With a profile, whether each function is part of a hot edge; empty
+	// when every function is grouped.
+	std::vector<bool> hot;
+	std::vector<unsigned> parents;
+
+	unsigned find(unsigned index)
+	{
+		while (parents[index] != index)
+		{
+			parents[index] = parents[parents[index]];
+			index = parents[index];
+		}
+		return index;
+	}
+
+	unsigned merge(unsigned left, unsigned right)
+	{
+		left = find(left);
+		right = find(right);
+		parents[std::max(left, right)] = std::min(left, right);
+		return std::min(left, right);
+	}
+
+	/**
+	 * Pack the clusters, largest first, into `count` partitions. Each
+	 * cluster goes to the partition it makes the most calls with among the
+	 * ones it still fits into, or to the smallest one if it fits nowhere.
+	 */
+	std::vector<std::vector<size_t>> pack(std::vector<std::vector<size_t>> clusters,
+										  unsigned count, uint64_t maxSize) const
+	{
+		std::vector<uint64_t> clusterSizes;
+		for (const auto &cluster : clusters)
+		{
+			uint64_t size = 0;
+			for (auto index : cluster)
+			{
+				size += sizes[index];
+			}
+			clusterSizes.push_back(size);
+		}
+
+		std::vector<size_t> order(clusters.size());
+		for (size_t index = 0; index < order.size(); index++)
+		{
+			order[index] = index;
+		}
+		std::stable_sort(order.begin(), order.end(), [&](size_t left, size_t right)
+						 { return clusterSizes[left] > clusterSizes[right]; });
+
+		std::vector<std::vector<std::pair<unsigned, uint64_t>>> neighbours(functions.size());
+		for (const auto &[edge, weight] : weights)
+		{
+			neighbours[edge.first].emplace_back(edge.second, weight);
+			neighbours[edge.second].emplace_back(edge.first, weight);
+		}
+
+		std::vector<std::vector<size_t>> bins(count);
+		std::vector<uint64_t> binSizes(count, 0);
+		std::vector<size_t> binOf(functions.size(), count);
+
+		for (auto cluster : order)
+		{
+			std::vector<uint64_t> affinity(count, 0);
+			for (auto index : clusters[cluster])
+			{
+				for (const auto &[neighbour, weight] : neighbours[index])
+				{
+					if (binOf[neighbour] < count)
+					{
+						affinity[binOf[neighbour]] += weight;
+					}
+				}
+			}
+
+			size_t best = 0;
+			bool fits = false;
+			for (size_t bin = 0; bin < count; bin++)
+			{
+				bool binFits = binSizes[bin] + clusterSizes[cluster] <= maxSize;
+				bool closer = affinity[bin] > affinity[best] ||
+							  (affinity[bin] == affinity[best] && binSizes[bin] < binSizes[best]);
+				if (binFits && (!fits || closer))
+				{
+					best = bin;
+					fits = true;
+				}
+				else if (!fits && binSizes[bin] < binSizes[best])
+				{
+					best = bin;
+				}
+			}
+
+			for (auto index : clusters[cluster])
+			{
+				bins[best].push_back(index);
+				binOf[index] = best;
+			}
+			binSizes[best] += clusterSizes[cluster];
+		}
+
+		bins.erase(std::remove_if(bins.begin(), bins.end(),
+								  [](const auto &bin) { return bin.empty(); }),
+				   bins.end());
+		for (auto &bin : bins)
+		{
+			std::sort(bin.begin(), bin.end());
+		}
+		return bins;
+	}
+};
+
+/**
+ * Places the mutable global variables which are accessed by the same
+ * functions in shared data modules, so that the data a function works
+ * on shares pages and mappings instead of being spread over one shared
+ * library per variable.
+ *
+ * Every pair of variables is weighted by the number of function modules
+ * accessing both, and the heaviest pairs are merged first, as long as the
+ * merged module stays within the size limit. Inside a data module, the
+ * variables are ordered by how many instructions access them, so that
+ * the hottest ones share the first page.
+ */
+class DataPlacement
+{
+  public:
+	/**
+	 * @param sizes The size in bytes of every global, by index.
+	 */
+	explicit DataPlacement(std::vector<uint64_t> sizes)
+		: sizes(std::move(sizes)), accesses(this->sizes.size(), 0)
+	{
+	}
+
+	/**
+	 * Add the variables accessed by one function module, with the number
+	 * of instructions accessing each of them.
+	 */
+	void addModule(const std::unordered_map<unsigned, uint64_t> &variableAccesses)
+	{
+		std::vector<unsigned> variables;
+		for (const auto &[variable, count] : variableAccesses)
+		{
+			accesses[variable] += count;
+			variables.push_back(variable);
+		}
+		std::sort(variables.begin(), variables.end());
+		for (size_t left = 0; left < variables.size(); left++)
+		{
+			for (size_t right = left + 1; right < variables.size(); right++)
+			{
+				coAccesses[{variables[left], variables[right]}]++;
+			}
+		}
+	}
+
+	/**
+	 * Group the `candidates` into data modules of at most `maxBytes` bytes.
+	 *
+	 * @return The groups of more than one variable, each ordered by
+	 * decreasing number of accesses. The other candidates stay alone.
+	 */
+	std::vector<std::vector<unsigned>> place(const std::vector<unsigned> &candidates,
+											 uint64_t maxBytes)
+	{
+		std::vector<bool> candidate(sizes.size(), false);
+		parents.resize(sizes.size());
+		bytes = sizes;
+		for (unsigned index = 0; index < sizes.size(); index++)
+		{
+			parents[index] = index;
+		}
+		for (auto index : candidates)
+		{
+			candidate[index] = true;
+		}
+
+		std::vector<std::pair<std::pair<unsigned, unsigned>, uint64_t>> edges;
+		for (const auto &[edge, weight] : coAccesses)
+		{
+			if (candidate[edge.first] && candidate[edge.second])
+			{
+				edges.emplace_back(edge, weight);
+			}
+		}
+		std::stable_sort(edges.begin(), edges.end(), [](const auto &left, const auto &right)
+						 { return left.second > right.second; });
+
+		for (const auto &[edge, weight] : edges)
+		{
+			auto left = find(edge.first);
+			auto right = find(edge.second);
+			if (left != right && bytes[left] + bytes[right] <= maxBytes)
+			{
+				auto root = std::min(left, right);
+				bytes[root] = bytes[left] + bytes[right];
+				parents[std::max(left, right)] = root;
+			}
+		}
+
+		std::map<unsigned, std::vector<unsigned>> groups;
+		for (auto index : candidates)
+		{
+			groups[find(index)].push_back(index);
+		}
+		std::vector<std::vector<unsigned>> result;
+		for (auto &[root, group] : groups)
+		{
+			if (group.size() < 2)
+			{
+				continue;
+			}
+			std::stable_sort(group.begin(), group.end(), [this](unsigned left, unsigned right)
+							 { return accesses[left] > accesses[right]; });
+			result.push_back(std::move(group));
+		}
+		return result;
+	}
+
+	/**
+	 * @return The number of pages of `pageSize` bytes the data of `group`
+	 * takes, at least one.
+	 */
+	uint64_t pages(const std::vector<unsigned> &group, uint64_t pageSize) const
+	{
+		uint64_t total = 0;
+		for (auto index : group)
+		{
+			total += sizes[index];
+		}
+		return std::max<uint64_t>(1, (total + pageSize - 1) / pageSize);
+	}
+
+  private:
+	std::vector<uint64_t> sizes;
+	std::vector<uint64_t> accesses;
+	// The number of function modules accessing both variables of a pair.
+	std::map<std::pair<unsigned, unsigned>, uint64_t> coAccesses;
+	std::vector<unsigned> parents;
+	std::vector<uint64_t> bytes;
+
+	unsigned find(unsigned index)
+	{
+		while (parents[index] != index)
+		{
+			parents[index] = parents[parents[index]];
+			index = parents[index];
+		}
+		return index;
+	}
+};
+
+/**
+ * Move the global variables `module` defines in the order of `values`,
+ * which is then the order of their data in the object file.
+ */
+void orderGlobals(llvm::Module &module, const std::vector<llvm::GlobalValue *> &values)
+{
+	for (const auto value : values)
+	{
+		auto global = module.getNamedGlobal(value->getName());
+		if (global && !global->isDeclaration())
+		{
+			global->removeFromParent();
+			module.getGlobalList().push_back(global);
+		}
+	}
+}
+
+/**
+ * Records how long the stages of the split, and the jobs run by the
+ * workers, take, for --time-report and --trace.
+ *
+ * Every span is tagged with the thread it ran on: 0 is the main
+ * thread and worker `n` is thread `n + 1`. When neither option is
+ * given nothing is recorded.
+ */
+class Timeline
+{
+  public:
+	struct Span
+	{
+		std::string name;
+		std::string category;
+		unsigned thread;
+		uint64_t start;
+		uint64_t duration;
+		std::string symbol;
+	};
+
+	bool enabled = false;
+
+	/**
+	 * @return The microseconds elapsed since the timeline was created.
+	 */
+	uint64_t now() const
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+				   std::chrono::steady_clock::now() - origin)
+			.count();
+	}
+
+	void add(Span span)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		spans.push_back(std::move(span));
+	}
+
+	/**
+	 * Write the spans as complete ("X") trace events, which chrome://tracing
+	 * and Perfetto can load.
+	 *
+	 * @return false if the file could not be written.
+	 */
+	bool writeTrace(const std::string &path, unsigned workers) const
+	{
+		std::error_code ecode;
+		llvm::raw_fd_ostream output(path, ecode);
+		if (ecode)
+		{
+			llvm::errs() << path << ": " << ecode.message() << "\n";
+			return false;
+		}
+
+		llvm::json::OStream json(output);
+		json.object(
+			[&]
+			{
+				json.attributeArray(
+					"traceEvents",
+					[&]
+					{
+						for (unsigned thread = 0; thread <= workers; thread++)
+						{
+							json.object(
+								[&]
+								{
+									json.attribute("name", "thread_name");
+									json.attribute("ph", "M");
+									json.attribute("pid", 1);
+									json.attribute("tid", thread);
+									json.attributeObject(
+										"args",
+										[&]
+										{
+											json.attribute("name",
+														   thread == 0 ? std::string("main")
+																	   : "worker " +
+																			 std::to_string(
+																				 thread - 1));
+										});
+								});
+						}
+
+						for (const auto &span : spans)
+						{
+							json.object(
+								[&]
+								{
+									json.attribute("name", span.name);
+									json.attribute("cat", span.category);
+									json.attribute("ph", "X");
+									json.attribute("pid", 1);
+									json.attribute("tid", span.thread);
+									json.attribute("ts", static_cast<int64_t>(span.start));
+									json.attribute("dur", static_cast<int64_t>(span.duration));
+									if (!span.symbol.empty())
+									{
+										json.attributeObject(
+											"args",
+											[&] { json.attribute("symbol", span.symbol); });
+									}
+								});
+						}
+					});
+			});
+		return true;
+	}
+
+	/**
+	 * Print the time taken by every stage, the time the workers spent
+	 * in each step of their jobs (summed over all of the workers) and
+	 * the slowest jobs.
+	 */
+	void printReport(std::ostream &stream) const
+	{
+		std::map<std::string, uint64_t> steps;
+		std::vector<const Span *> jobs;
+		stream << "time report:\n";
+		for (const auto &span : spans)
+		{
+			if (span.category == "stage")
+			{
+				stream << "  " << span.name << ": " << seconds(span.duration) << "s\n";
+			}
+			else if (span.category == "step")
+			{
+				steps[span.name] += span.duration;
+			}
+			else if (span.category == "job")
+			{
+				jobs.push_back(&span);
+			}
+		}
+
+		stream << "  " << jobs.size() << " jobs, time spent by the workers in:";
+		for (const auto &[step, duration] : steps)
+		{
+			stream << " " << step << " " << seconds(duration) << "s";
+		}
+		stream << "\n";
+
+		const size_t slowest = std::min<size_t>(jobs.size(), 5);
+		std::partial_sort(jobs.begin(), jobs.begin() + slowest, jobs.end(),
+						  [](const Span *left, const Span *right)
+						  { return left->duration > right->duration; });
+		for (size_t job = 0; job < slowest; job++)
+		{
+			stream << "  slowest: " << jobs[job]->name << " " << seconds(jobs[job]->duration)
+				   << "s on worker " << jobs[job]->thread - 1 << "\n";
+		}
+	}
+
+  private:
+	const std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+	std::vector<Span> spans;
+	std::mutex lock;
+
+	static std::string seconds(uint64_t microseconds)
+	{
+		std::stringstream text;
+		text.setf(std::ios::fixed);
+		text.precision(3);
+		text << microseconds / 1e6;
+		return text.str();
+	}
+};
+
+Timeline timeline;
+
+/**
+ * Adds a span covering its own lifetime to the timeline.
+ */
+class TimedScope
+{
+  public:
+	TimedScope(std::string name, std::string category, unsigned thread = 0,
+			   std::string symbol = "")
+	{
+		if (timeline.enabled)
+		{
+			span = {std::move(name), std::move(category), thread, timeline.now(), 0,
+					std::move(symbol)};
+		}
+	}
+
+	~TimedScope()
+	{
+		if (span)
+		{
+			span->duration = timeline.now() - span->start;
+			timeline.add(std::move(*span));
+		}
+	}
+
+  private:
+	llvm::Optional<Timeline::Span> span;
+};
+
+/**
+ * A pool of worker threads where each worker owns a deque of jobs.
+ *
+ * A worker takes jobs from the front of its own deque and, once that
+ * is empty, steals from the back of the other workers' deques, so a few
+ * expensive jobs do not leave the rest of the workers idle.
+ */
+class WorkStealingPool
+{
+  public:
+	explicit WorkStealingPool(unsigned workers)
+		: queues(std::max(1u, workers)), locks(queues.size())
+	{
+	}
+
+	unsigned size() const
+	{
+		return queues.size();
+	}
+
+	/**
+	 * Run `fn(worker)` once on every worker, each on its own thread.
+	 */
+	template <typename Fn> void forEachWorker(Fn fn)
+	{
+		std::vector<std::thread> threads;
+		for (unsigned worker = 0; worker < size(); worker++)
+		{
+			threads.emplace_back(fn, worker);
+		}
+		for (auto &thread : threads)
+		{
+			thread.join();
+		}
+	}
+
+	/**
+	 * Run `fn(worker, job)` for every job in [0, count) and wait
+	 * for all of them to finish.
+	 */
+	template <typename Fn> void run(size_t count, Fn fn)
+	{
+		for (size_t job = 0; job < count; job++)
+		{
+			queues[job * size() / std::max<size_t>(count, 1)].push_back(job);
+		}
+
+		forEachWorker(
+			[&](unsigned worker)
+			{
+				size_t job;
+				while (take(worker, job))
+				{
+					fn(worker, job);
+				}
+			});
+	}
+
+  private:
+	std::vector<std::deque<size_t>> queues;
+	std::vector<std::mutex> locks;
+
+	bool take(unsigned worker, size_t &job)
+	{
+		{
+			std::lock_guard<std::mutex> guard(locks[worker]);
+			if (!queues[worker].empty())
+			{
+				job = queues[worker].front();
+				queues[worker].pop_front();
+				return true;
+			}
+		}
+
+		for (unsigned offset = 1; offset < size(); offset++)
+		{
+			auto victim = (worker + offset) % size();
+			std::lock_guard<std::mutex> guard(locks[victim]);
+			if (!queues[victim].empty())
+			{
+				job = queues[victim].back();
+				queues[victim].pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+/**
+ * The state owned by a single worker: its own context and its own
+ * copy of the module, so that workers never share LLVM objects.
+ */
+struct Worker
+{
+	llvm::LLVMContext context;
+	std::unique_ptr<llvm::Module> module;
+	std::unique_ptr<ConstantOperandCache> cache;
+	std::unique_ptr<llvm::TargetMachine> targetMachine;
+	std::vector<llvm::Function *> functions;
+	uint64_t naiveVisits = 0;
+	// The thread of the worker in the timeline.
+	unsigned thread = 0;
+};
+
+/**
+ * @return The peak resident set size of the process so far, in KiB.
+ */
+uint64_t peakRss()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024;
+#else
+	return usage.ru_maxrss;
+#endif
+}
+
+/**
+ * @return The resident set size of the process, in KiB, or the peak one
+ * where it cannot be read.
+ */
+uint64_t currentRss()
+{
+	std::ifstream statm("/proc/self/statm");
+	uint64_t size, resident;
+	if (statm >> size >> resident)
+	{
+		return resident * sysconf(_SC_PAGESIZE) / 1024;
+	}
+	return peakRss();
+}
+
+/**
+ * Holds the jobs back while the resident memory is over a limit, for
+ * --max-rss. A job only waits while other jobs run, as they are the ones
+ * which can free memory, so that one job always makes progress even if
+ * the limit cannot be met.
+ */
+class MemoryThrottle
+{
+  public:
+	/**
+	 * @param limit The resident memory to stay under, in KiB, or 0 for no
+	 * limit.
+	 */
+	explicit MemoryThrottle(uint64_t limit) : limit(limit)
+	{
+	}
+
+	/**
+	 * Counts as a running job from its creation to its destruction, once
+	 * there is memory for it.
+	 */
+	class Job
+	{
+	  public:
+		explicit Job(MemoryThrottle &throttle) : throttle(throttle)
+		{
+			throttle.enter();
+		}
+
+		~Job()
+		{
+			throttle.leave();
+		}
+
+	  private:
+		MemoryThrottle &throttle;
+	};
+
+	/**
+	 * @return The number of jobs which had to wait for memory.
+	 */
+	size_t waited() const
+	{
+		return waits;
+	}
+
+  private:
+	const uint64_t limit;
+	size_t running = 0;
+	std::atomic<size_t> waits{0};
+	std::mutex lock;
+	std::condition_variable finished;
+
+	void enter()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		auto fits = [this] { return limit == 0 || running == 0 || currentRss() < limit; };
+		if (!fits())
+		{
+			waits++;
+			finished.wait(guard, fits);
+		}
+		running++;
+	}
+
+	void leave()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			running--;
+		}
+		finished.notify_all();
+	}
+};
+
+/**
+ * Load an input, either entirely or, if `lazily` (with --streaming),
+ * only the globals, constants and function prototypes, the bodies being
+ * materialized when they are needed. `input` must outlive the module.
+ */
+std::unique_ptr<llvm::Module> loadInput(const llvm::MemoryBuffer &input,
+										llvm::SMDiagnostic &diagnostic,
+										llvm::LLVMContext &moduleContext, bool lazily)
+{
+	if (lazily)
+	{
+		return llvm::getLazyIRModule(
+			llvm::MemoryBuffer::getMemBuffer(input.getMemBufferRef(), false), diagnostic,
+			moduleContext);
+	}
+	return llvm::parseIR(input.getMemBufferRef(), diagnostic, moduleContext);
+}
+
+/**
+ * The changes needed to split one of several inputs on its own, the
+ * way the linker would have resolved its symbols had they been linked
+ * together first.
+ */
+struct SymbolResolution
+{
+	// The local symbols whose name is used by another input, and the
+	// name they are given instead.
+	std::map<std::string, std::string> renames;
+	// The symbols another input defines. Duplicate definitions of them
+	// (inline functions, weak or common symbols) are turned into
+	// declarations and they are not extracted from this input.
+	std::unordered_set<std::string> foreign;
+	// The constants defined here which other inputs use. Instead of
+	// being copied into the modules using them, they are extracted on
+	// their own, as the modules of the other inputs cannot copy them.
+	std::unordered_set<std::string> exported;
+};
+
+/**
+ * @return How strongly `value` is defined: the definition with the
+ * highest rank is the one kept.
+ */
+static int definitionRank(const llvm::GlobalValue &value)
+{
+	if (value.hasAvailableExternallyLinkage())
+	{
+		return 0;
+	}
+	return value.isWeakForLinker() ? 1 : 2;
+}
+
+/**
+ * Resolve the symbols of several inputs against each other. Every
+ * symbol is defined by a single input: the first one with a strong
+ * definition, or else the first one with a weak one. Local symbols
+ * keep their name unless another input already uses it.
+ *
+ * @return false if a symbol has a strong definition in several inputs.
+ */
+bool resolveSymbols(const std::vector<std::string> &inputs,
+					const std::vector<std::unique_ptr<llvm::Module>> &modules,
+					std::vector<SymbolResolution> &resolutions)
+{
+	struct Definition
+	{
+		size_t input;
+		int rank;
+		bool constant;
+	};
+	std::unordered_map<std::string, Definition> owners;
+	std::unordered_set<std::string> taken;
+	bool resolved = true;
+
+	for (size_t input = 0; input < modules.size(); input++)
+	{
+		for (const auto &value : modules[input]->global_values())
+		{
+			if (!value.hasName() || value.hasLocalLinkage())
+			{
+				continue;
+			}
+			const auto name = value.getName().str();
+			taken.insert(name);
+			if (value.isDeclaration())
+			{
+				continue;
+			}
+
+			auto variable = llvm::dyn_cast<llvm::GlobalVariable>(&value);
+			Definition definition = {input, definitionRank(value),
+									 variable && variable->isConstant()};
+			auto [owner, inserted] = owners.emplace(name, definition);
+			if (inserted)
+			{
+				continue;
+			}
+			if (owner->second.rank == 2 && definition.rank == 2)
+			{
+				llvm::errs() << "multiple definitions of '" << name << "' in "
+							 << inputs[owner->second.input] << " and " << inputs[input] << "\n";
+				resolved = false;
+			}
+			else if (definition.rank > owner->second.rank)
+			{
+				owner->second = definition;
+			}
+		}
+	}
+
+	resolutions.assign(modules.size(), SymbolResolution());
+	for (size_t input = 0; input < modules.size(); input++)
+	{
+		for (const auto &value : modules[input]->global_values())
+		{
+			if (!value.hasName() || value.hasLocalLinkage())
+			{
+				continue;
+			}
+			auto owner = owners.find(value.getName().str());
+			if (owner == owners.end() || owner->second.input == input)
+			{
+				continue;
+			}
+			resolutions[input].foreign.insert(owner->first);
+			if (owner->second.constant)
+			{
+				resolutions[owner->second.input].exported.insert(owner->first);
+			}
+		}
+	}
+
+	for (size_t input = 0; input < modules.size(); input++)
+	{
+		for (const auto &value : modules[input]->global_values())
+		{
+			if (!value.hasName() || !value.hasLocalLinkage())
+			{
+				continue;
+			}
+			const auto name = value.getName().str();
+			auto newName = name;
+			for (auto suffix = input; !taken.insert(newName).second; suffix++)
+			{
+				newName = name + "." + std::to_string(suffix);
+			}
+			if (newName != name)
+			{
+				resolutions[input].renames.emplace(name, newName);
+			}
+		}
+	}
+	return resolved;
+}
+
+/**
+ * Apply the resolution of the symbols of an input to its module.
+ */
+void applyResolution(llvm::Module &module, const SymbolResolution &resolution)
+{
+	std::vector<std::pair<llvm::GlobalValue *, std::string>> renamed;
+	for (auto &value : module.global_values())
+	{
+		const auto name = value.getName().str();
+		if (value.hasLocalLinkage())
+		{
+			auto rename = resolution.renames.find(name);
+			if (rename != resolution.renames.end())
+			{
+				renamed.emplace_back(&value, rename->second);
+			}
+			continue;
+		}
+		if (value.isDeclaration() || resolution.foreign.find(name) == resolution.foreign.end())
+		{
+			continue;
+		}
+
+		if (auto function = llvm::dyn_cast<llvm::Function>(&value))
+		{
+			function->deleteBody();
+			function->setComdat(nullptr);
+		}
+		else if (auto variable = llvm::dyn_cast<llvm::GlobalVariable>(&value))
+		{
+			variable->setInitializer(nullptr);
+			variable->setLinkage(llvm::GlobalValue::ExternalLinkage);
+			variable->setComdat(nullptr);
+		}
+	}
+
+	// All of the old names are cleared first, so that the new name of a
+	// value is never still taken by another value being renamed.
+	for (auto &[value, name] : renamed)
+	{
+		value->setName("");
+	}
+	for (auto &[value, name] : renamed)
+	{
+		value->setName(name);
+	}
+}
+
+/**
+ * This is the first stage of the split, where all the properties
+ * of the globals and functions in the module are changed, so that
+ * they can be referenced from other modules.
+ */
+void publicizeSymbols(llvm::Module &module)
+{
+	for (auto &global : module.globals())
+	{
+		if (!global.hasHiddenVisibility())
+		{
+			global.setDSOLocal(false);
+			global.setLinkage(llvm::GlobalValue::LinkageTypes::ExternalLinkage);
+			global.setVisibility(llvm::GlobalValue::VisibilityTypes::DefaultVisibility);
+		}
+	}
+
+	for (auto &function : module.functions())
+	{
+		if (function.isDeclaration())
+		{
+			continue;
+		}
+		function.setDSOLocal(false);
+		function.setLinkage(llvm::GlobalValue::ExternalLinkage);
+		function.setVisibility(llvm::GlobalValue::VisibilityTypes::DefaultVisibility);
+	}
+}
+
+/**
+ * This is the third stage of the split.
+ *
+ * Here all of the already moved variables' definitions get changed to
+ * declarations. This is done because when moving the extraction will just
+ * copy the referenced globals, but that means that it will copy it as an
+ * empty definition, which will fail when compiling, when changed to a
+ * declaration it would expect the global to be defined in an external module.
+ *
+ * The globals marked in `kept`, by index, are extracted with functions in
+ * stage 4 instead, and keep their definition.
+ */
+void declareMovedGlobals(llvm::Module &module, const std::vector<bool> &kept)
+{
+	size_t index = 0;
+	for (auto &global : module.globals())
+	{
+		if (kept[index++] || global.isConstant())
+		{
+			continue;
+		}
+		global.setDSOLocal(false);
+		global.setInitializer(nullptr);
+	}
+}
+
+/**
+ * Undo, within an extracted module, what stages 1 and 3 did to the
+ * symbols it defines: publicizing made every reference go through the
+ * GOT or the PLT, but the definitions that ended up in `module` are
+ * reached directly, as in the unsplit program. Marking them `dso_local`
+ * makes the code generator use local aliases for them in position
+ * independent code, while the other modules still find them in the
+ * dynamic symbol table. The declarations of the symbols defined in other
+ * modules keep their indirection.
+ *
+ * Weak and linkonce definitions are left alone, as another definition
+ * may be chosen for them at run time.
+ *
+ * @return The number of definitions used within `module` made `dso_local`.
+ */
+size_t localizeReferences(llvm::Module &module)
+{
+	size_t localized = 0;
+	for (auto &value : module.global_values())
+	{
+		if (value.isDeclaration() || value.hasLocalLinkage() || value.isDSOLocal() ||
+			value.isInterposable() || value.hasAvailableExternallyLinkage() ||
+			llvm::isa<llvm::GlobalIFunc>(value))
+		{
+			continue;
+		}
+		value.setDSOLocal(true);
+		localized += !value.use_empty();
+	}
+	return localized;
+}
+
+/**
+ * @return The functions accessing `variable`, directly or through
+ * constant expressions, with the number of instructions doing so.
+ */
+std::map<std::string, unsigned> accessingFunctions(const llvm::GlobalVariable &variable)
+{
+	std::map<std::string, unsigned> functions;
+	std::stack<const llvm::User *> pending;
+	std::unordered_set<const llvm::User *> seen;
+	for (const auto user : variable.users())
+	{
+		pending.push(user);
+	}
+	while (!pending.empty())
+	{
+		auto user = pending.top();
+		pending.pop();
+		if (auto instruction = llvm::dyn_cast<llvm::Instruction>(user))
+		{
+			functions[instruction->getFunction()->getName().str()]++;
+		}
+		else if (llvm::isa<llvm::Constant>(user) && !llvm::isa<llvm::GlobalValue>(user) &&
+				 seen.insert(user).second)
+		{
+			for (const auto next : user->users())
+			{
+				pending.push(next);
+			}
+		}
+	}
+	return functions;
+}
+
+/**
+ * @return The name of the global stage 2 extracts for `globalVariable`,
+ * or an empty string if it is not extracted on its own.
+ */
+std::string getExtractedGlobalName(llvm::GlobalVariable &globalVariable)
+{
+	if (globalVariable.isConstant() && globalVariable.hasInitializer())
+	{
+		if (!globalVariable.getInitializer()->hasName())
+		{
+			return "";
+		}
+		return globalVariable.getInitializer()->getName().str();
+	}
+	return globalVariable.getName().str();
+}
+
+/**
+ * Split the inputs in `buffers`, named after their buffer identifier.
+ */
+static bool run(const std::vector<std::unique_ptr<llvm::MemoryBuffer>> &buffers,
+				const Options &options)
+{
+	timeline.enabled = options.timeReport || !options.traceFile.empty();
+	std::ostream discarded(nullptr);
+	auto &log = options.log ? *options.log : discarded;
+	const unsigned jobs =
+		options.jobs != 0 ? options.jobs : std::max(1u, std::thread::hardware_concurrency());
+
+	std::vector<std::string> inputs;
+	for (const auto &buffer : buffers)
+	{
+		inputs.push_back(buffer->getBufferIdentifier().str());
+	}
+
+	if (options.emit != EmitKind::Bitcode)
+	{
+		llvm::InitializeAllTargetInfos();
+		llvm::InitializeAllTargets();
+		llvm::InitializeAllTargetMCs();
+		llvm::InitializeAllAsmPrinters();
+	}
+
+	if (options.lazyStubs && (inputs.size() > 1 || options.callTables))
+	{
+		llvm::errs() << "--lazy-stubs needs a single input, and replaces --call-tables\n";
+		return false;
+	}
+
+	const bool grouped = options.partitions > 0 || options.maxPartitionSize > 0 ||
+						 options.useProfileMetadata || !options.profileFile.empty();
+	if (options.streaming &&
+		(grouped || options.constantPool || options.dataModules || options.leafCloneSize > 0))
+	{
+		llvm::errs() << "--streaming needs every function body at once for grouping, "
+						"--constant-pool, --data-modules and --clone-leaves\n";
+		return false;
+	}
+
+	// Every input is parsed into a context of its own, so that they
+	// can all be parsed at the same time.
+	auto parseScope = std::make_unique<TimedScope>("parse", "stage");
+	const auto rssBeforeParse = peakRss();
+	std::vector<std::unique_ptr<llvm::LLVMContext>> contexts;
+	std::vector<std::unique_ptr<llvm::Module>> loadedModules(inputs.size());
+	for (size_t input = 0; input < inputs.size(); input++)
+	{
+		contexts.push_back(std::make_unique<llvm::LLVMContext>());
+	}
+	std::atomic<bool> parseFailed(false);
+	WorkStealingPool(jobs).run(inputs.size(),
+							   [&](unsigned, size_t input)
+							   {
+								   llvm::SMDiagnostic diagnostic;
+								   loadedModules[input] =
+									   loadInput(*buffers[input], diagnostic, *contexts[input],
+												 options.streaming);
+								   if (!loadedModules[input])
+								   {
+									   std::lock_guard<std::mutex> guard(outputMutex);
+									   diagnostic.print(nullptr, llvm::errs());
+									   parseFailed = true;
+								   }
+							   });
+	const auto moduleRss = peakRss() - rssBeforeParse;
+	parseScope.reset();
+
+	if (parseFailed)
+	{
+		return false;
+	}
+
+	// The target machines are created by every worker, check once that
+	// they can be, instead of failing in every job.
+	if (options.emit != EmitKind::Bitcode)
+	{
+		for (const auto &module : loadedModules)
+		{
+			if (!createTargetMachine(*module, options.codegenOptLevel))
+			{
+				return false;
+			}
+		}
+	}
+
+	// The thread-local variables are placed according to the functions
+	// accessing them, which are only known once every body is loaded.
+	if (options.streaming)
+	{
+		for (size_t input = 0; input < inputs.size(); input++)
+		{
+			for (const auto &global : loadedModules[input]->globals())
+			{
+				if (global.isThreadLocal() && !global.isConstant() && !global.isDeclaration())
+				{
+					llvm::errs() << inputs[input] << ": --streaming cannot place the thread-local "
+								 << "variable " << global.getName()
+								 << ", which needs every function body at once\n";
+					return false;
+				}
+			}
+		}
+	}
+
+	// Several inputs are split one after the other, once their symbols
+	// are resolved against each other.
+	std::vector<SymbolResolution> resolutions(inputs.size());
+	if (inputs.size() > 1)
+	{
+		TimedScope scope("resolve symbols", "stage");
+		if (!resolveSymbols(inputs, loadedModules, resolutions))
+		{
+			return false;
+		}
+	}
+
+	// Create directory if it does not exist
+	std::filesystem::create_directory(options.outputDirectory.c_str());
+
+	Manifest manifest(options.outputDirectory, options.archive);
+
+	// With --archive, the modules the manifest says are unchanged are
+	// copied over from the previous archive.
+	const auto archivePath = options.outputDirectory + "/split.archive";
+	splitArchive::Writer archiveWriter;
+	std::unique_ptr<splitArchive::Reader> previousArchive;
+	if (options.archive && std::filesystem::exists(archivePath))
+	{
+		std::string error;
+		previousArchive = splitArchive::Reader::open(archivePath, error);
+		if (!previousArchive)
+		{
+			llvm::errs() << "warning: " << error << ", extracting every module\n";
+		}
+	}
+	std::atomic<size_t> extractedCount(0);
+	std::atomic<size_t> unchangedCount(0);
+	// Set when an output could not be written, generated or linked, which
+	// makes the exit status 1 once everything else has been written.
+	std::atomic<bool> writeFailed(false);
+	std::atomic<uint64_t> bytesBeforeCompact(0);
+	std::atomic<uint64_t> bytesAfterCompact(0);
+	std::atomic<size_t> tableCalls(0);
+	std::atomic<size_t> localReferences(0);
+	std::atomic<size_t> leafCopies(0);
+	std::atomic<size_t> leafCalls(0);
+	std::atomic<uint64_t> leafInstructions(0);
+	std::unordered_set<std::string> clonedLeaves;
+
+	// The accesses to thread-local variables defined in another module,
+	// as "<module> <function> <variable> <defining module> <instructions>
+	// <model>" lines.
+	std::vector<std::string> threadLocalReport;
+	size_t threadLocalCrossings = 0;
+	size_t threadLocalGeneralDynamic = 0;
+
+	// The functions defined in the input being split, once its symbols are
+	// resolved. Unlike the worker modules, this does not change as the
+	// functions are extracted (and with --streaming, freed).
+	std::unordered_set<std::string> definedFunctions;
+
+	// With --lazy-stubs, the module defining every function loaded on
+	// demand, and the modules which are linked as usual instead.
+	std::unordered_map<std::string, std::string> lazyLibraries;
+	std::unordered_set<std::string> lazyModules;
+	std::vector<std::string> eagerModules;
+
+	// With --export-lists, what every module defines and imports.
+	std::map<std::string, ModuleSymbols> moduleSymbols;
+
+	// With --export-lists and --emit=so, the libraries are only linked once
+	// their version scripts are written, as they depend on every module.
+	// Whether a library is linked again then also depends on whether its
+	// script changed, the value tells whether anything else requires it.
+	std::map<std::string, bool> deferredLinks;
+
+	/**
+	 * Extract `values` to `_<name>.bc`, unless the manifest shows
+	 * the module would be the same as the one already written.
+	 */
+	auto emit = [&](Worker &worker, const std::vector<llvm::GlobalValue *> &values,
+					const std::string &name, std::stringstream &description,
+					bool inValueOrder = false)
+	{
+		const auto fileName = "_" + name + ".bc";
+		const auto outputPath = options.outputDirectory + "/" + fileName;
+		const auto objectPath = options.outputDirectory + "/_" + name + ".o";
+		const auto libraryPath = options.outputDirectory + "/lib_" + name + ".so";
+		const bool link = options.emit == EmitKind::SharedLibrary && name != "main";
+		auto hashScope = std::make_unique<TimedScope>("hash", "step", worker.thread);
+		const auto hash =
+			hashExtraction(*worker.module, values, options, definedFunctions, lazyLibraries);
+		hashScope.reset();
+		const auto previousBitcode =
+			previousArchive ? previousArchive->find(fileName) : llvm::None;
+		const bool bitcodeExists =
+			options.archive ? previousBitcode.hasValue() : std::filesystem::exists(outputPath);
+		const bool objectExists =
+			options.emit == EmitKind::Bitcode || std::filesystem::exists(objectPath);
+		const bool libraryExists = !link || std::filesystem::exists(libraryPath);
+		const auto entry = manifest.moduleEntry(fileName);
+		const bool unchanged = !options.force && manifest.isUnchanged(entry, hash) &&
+							   bitcodeExists && objectExists && libraryExists;
+
+		description << "-o " << outputPath << (unchanged ? " (unchanged)" : "") << "\n\n";
+		{
+			std::lock_guard<std::mutex> guard(outputMutex);
+			log << description.str();
+		}
+
+		if (options.lazyStubs && name != "main" && lazyModules.find(name) == lazyModules.end())
+		{
+			std::lock_guard<std::mutex> guard(outputMutex);
+			eagerModules.push_back(name);
+		}
+
+		manifest.record(entry, hash, values);
+		if (options.dry || unchanged)
+		{
+			unchangedCount += unchanged;
+			if (!options.dry && options.archive)
+			{
+				archiveWriter.add(fileName, previousBitcode->data.str());
+			}
+			if (!options.dry && options.exportLists)
+			{
+				auto previous = previousBitcode ? llvm::MemoryBuffer::getMemBuffer(
+													  previousBitcode->data, fileName, false)
+												: llvm::MemoryBuffer::getFile(outputPath);
+				auto symbols =
+					previous ? readSymbols((*previous)->getBuffer(), fileName) : llvm::None;
+				std::lock_guard<std::mutex> guard(outputMutex);
+				if (link)
+				{
+					deferredLinks[name] = false;
+				}
+				if (symbols)
+				{
+					moduleSymbols[name] = std::move(*symbols);
+				}
+				else
+				{
+					llvm::errs() << "warning: " << fileName
+								 << " could not be read, it is left out of the export lists\n";
+				}
+			}
+			return;
+		}
+		auto extractScope = std::make_unique<TimedScope>("extract", "step", worker.thread);
+		auto extracted = extractModule(*worker.module, values);
+		if (inValueOrder)
+		{
+			orderGlobals(*extracted, values);
+		}
+		extractScope.reset();
+
+		if (options.leafCloneSize > 0)
+		{
+			TimedScope scope("clone leaves", "step", worker.thread);
+			auto clones = cloneLeafCallees(*extracted, *worker.module, options.leafCloneSize);
+			leafCopies += clones.functions.size();
+			leafCalls += clones.calls;
+			leafInstructions += clones.instructions;
+
+			std::lock_guard<std::mutex> guard(outputMutex);
+			clonedLeaves.insert(clones.functions.begin(), clones.functions.end());
+		}
+
+		if (options.compact)
+		{
+			TimedScope scope("compact", "step", worker.thread);
+			auto before = bitcodeSize(*extracted);
+			compactModule(*extracted, options.stripDebug);
+			auto after = bitcodeSize(*extracted);
+			bytesBeforeCompact += before;
+			bytesAfterCompact += after;
+
+			std::lock_guard<std::mutex> guard(outputMutex);
+			log << "compact: " << fileName << " " << before << " -> " << after
+					  << " bytes\n";
+		}
+		localReferences += localizeReferences(*extracted);
+		if (options.lazyStubs)
+		{
+			TimedScope scope("lazy stubs", "step", worker.thread);
+			addLazyStubs(*extracted, lazyLibraries);
+		}
+		if (options.callTables)
+		{
+			TimedScope scope("call tables", "step", worker.thread);
+			tableCalls += addCallTables(*extracted, definedFunctions, "__split_calls." + name);
+		}
+		if (options.exportLists)
+		{
+			auto symbols = collectSymbols(*extracted);
+			std::lock_guard<std::mutex> guard(outputMutex);
+			moduleSymbols[name] = std::move(symbols);
+		}
+		{
+			TimedScope scope("write bitcode", "step", worker.thread);
+			if (options.archive)
+			{
+				std::string data;
+				llvm::raw_string_ostream dataStream(data);
+				llvm::WriteBitcodeToFile(*extracted, dataStream);
+				archiveWriter.add(fileName, std::move(dataStream.str()));
+			}
+			else if (!writeBitcode(*extracted, outputPath))
+			{
+				writeFailed = true;
+			}
+		}
+		extractedCount++;
+
+		if (options.emit == EmitKind::Bitcode)
+		{
+			return;
+		}
+		bool objectChanged = true;
+		{
+			TimedScope scope("codegen", "step", worker.thread);
+			if (!writeObject(*worker.targetMachine, *extracted, objectPath, &objectChanged))
+			{
+				writeFailed = true;
+				return;
+			}
+		}
+		// The library is only linked again when its object file changed, when
+		// it is missing or with -f (after changing the linker flags).
+		if (link && options.exportLists)
+		{
+			std::lock_guard<std::mutex> guard(outputMutex);
+			deferredLinks[name] = objectChanged || !libraryExists || options.force;
+		}
+		else if (link && (objectChanged || !libraryExists || options.force))
+		{
+			TimedScope scope("link", "step", worker.thread);
+			if (!linkSharedLibrary(options, objectPath, libraryPath))
+			{
+				writeFailed = true;
+			}
+		}
+	};
+
+	// Every worker holds a lazily loaded module and the function it is
+	// extracting, which is assumed to take twice the memory the lazily
+	// loaded module took. That only sizes the pool, the throttle then holds
+	// the jobs back whenever the memory actually in use gets over the limit.
+	MemoryThrottle throttle(options.streaming ? options.maxRss * 1024 : 0);
+	unsigned workerCount = jobs;
+	if (options.streaming && options.maxRss > 0)
+	{
+		const uint64_t limit = options.maxRss * 1024;
+		const uint64_t perWorker = std::max<uint64_t>(2 * moduleRss / inputs.size(), 1);
+		const uint64_t used = peakRss();
+		workerCount = std::max<uint64_t>(
+			1, std::min<uint64_t>(jobs, used < limit ? (limit - used) / perWorker : 0));
+		log << "streaming: " << workerCount << " workers, about " << perWorker / 1024
+				  << " MiB each, to stay under " << options.maxRss << " MiB\n";
+	}
+
+	WorkStealingPool pool(workerCount);
+
+	uint64_t graphSize = 0;
+	uint64_t graphEdges = 0;
+	uint64_t graphComponents = 0;
+	uint64_t operandVisits = 0;
+	uint64_t naiveVisits = 0;
+
+	for (size_t input = 0; input < inputs.size(); input++)
+	{
+		/**
+		 * Moving happens on multiple stages.
+		 *
+		 * The first stage is done once, on the loaded module. The result
+		 * is then handed to every worker, which parses it into its own
+		 * context, so that the analysis and extraction of the remaining
+		 * stages can run on all of them at the same time.
+		 *
+		 * With --streaming, the module is not written out again, as that
+		 * would materialize all of it: every worker loads the input lazily
+		 * and redoes the first stage itself.
+		 */
+		auto loadedModule = std::move(loadedModules[input]);
+		const auto &resolution = resolutions[input];
+		// Names of the modules which are not named after a symbol, made
+		// unique across inputs.
+		const auto inputSuffix = inputs.size() > 1 ? "." + std::to_string(input) : "";
+		{
+			TimedScope scope("stage 1: publicize symbols", "stage");
+			applyResolution(*loadedModule, resolution);
+			publicizeSymbols(*loadedModule);
+		}
+		definedFunctions.clear();
+		for (const auto &function : loadedModule->functions())
+		{
+			if (!function.isDeclaration())
+			{
+				definedFunctions.insert(function.getName().str());
+			}
+		}
+
+		// Stage 2 jobs, as the index of the global and the name of the
+		// global extracted for it. Later globals mapping to the same
+		// output replace earlier ones. The constants other inputs use
+		// are extracted on their own, instead of being copied.
+		std::vector<std::pair<size_t, std::string>> globalJobs;
+		std::unordered_map<std::string, size_t> globalJobByName;
+		std::vector<size_t> exportedConstants;
+		size_t globalIndex = 0;
+		for (auto &globalVariable : loadedModule->globals())
+		{
+			const auto name = globalVariable.getName().str();
+			auto globName = getExtractedGlobalName(globalVariable);
+			if (resolution.foreign.find(name) != resolution.foreign.end())
+			{
+				globName = "";
+			}
+			else if (resolution.exported.find(name) != resolution.exported.end())
+			{
+				globName = name;
+				exportedConstants.push_back(globalIndex);
+			}
+			if (!globName.empty())
+			{
+				auto [existing, inserted] = globalJobByName.emplace(globName, globalJobs.size());
+				if (inserted)
+				{
+					globalJobs.emplace_back(globalIndex, globName);
+				}
+				else
+				{
+					globalJobs[existing->second].first = globalIndex;
+				}
+			}
+			globalIndex++;
+		}
+
+		// The dependency graph only depends on the constants, which stay
+		// the same across all of the stages, so it is shared by all workers.
+		auto graphScope = std::make_unique<TimedScope>("dependency graph", "stage");
+		ConstantOperandCache graphCache(*loadedModule);
+		GlobalDependencyGraph graph(graphCache);
+		graphScope.reset();
+
+		// The functions extracted together in stage 4, by their index.
+		// Unless they are grouped, every function is on its own.
+		std::vector<std::vector<size_t>> functionPartitions;
+		if (grouped)
+		{
+			TimedScope scope("partition", "stage");
+			CallGraphPartitioner partitioner(*loadedModule);
+
+			if (options.useProfileMetadata || !options.profileFile.empty())
+			{
+				CallProfile profile;
+				if (options.useProfileMetadata)
+				{
+					profile.readMetadata(*loadedModule);
+				}
+				if (!options.profileFile.empty() && !profile.readFile(options.profileFile))
+				{
+					return false;
+				}
+				if (profile.empty())
+				{
+					llvm::errs() << "warning: the profile contains no counts\n";
+				}
+				log << "profile: " << partitioner.useProfile(profile, options.hotFraction)
+						  << " hot call edges\n";
+			}
+
+			functionPartitions =
+				partitioner.partition(options.partitions, options.maxPartitionSize);
+			log << "call graph: " << partitioner.totalCalls()
+					  << " calls cross modules with one function per module, "
+					  << partitioner.crossingCalls(functionPartitions) << " with "
+					  << functionPartitions.size() << " partitions\n";
+		}
+		else
+		{
+			size_t functionIndex = 0;
+			for (auto &function : loadedModule->functions())
+			{
+				if (!function.isDeclaration())
+				{
+					functionPartitions.push_back({functionIndex});
+				}
+				functionIndex++;
+			}
+		}
+
+		// The name of the module of every partition: the partition with
+		// `main` is named after it, as that is what the joiner links the
+		// executable from.
+		std::vector<std::string> partitionNames;
+		{
+			std::vector<llvm::Function *> functions;
+			for (auto &function : loadedModule->functions())
+			{
+				functions.push_back(&function);
+			}
+			for (size_t job = 0; job < functionPartitions.size(); job++)
+			{
+				const auto &partition = functionPartitions[job];
+				std::string name;
+				for (auto functionIndex : partition)
+				{
+					auto &function = *functions[functionIndex];
+					if (partition.size() == 1 || function.getName() == "main")
+					{
+						name = function.getName().str();
+					}
+				}
+				if (name.empty())
+				{
+					name = "partition" + inputSuffix + "." + std::to_string(job);
+				}
+				partitionNames.push_back(name);
+
+				if (options.lazyStubs && name != "main")
+				{
+					lazyModules.insert(name);
+					for (auto functionIndex : partition)
+					{
+						lazyLibraries.emplace(functions[functionIndex]->getName().str(), name);
+					}
+				}
+			}
+		}
+
+		// A thread-local variable in a library of its own is only reached
+		// with the general-dynamic model, a call to __tls_get_addr for
+		// every access. Instead, it is defined in the module with `main`,
+		// the executable, whose thread-local block is static, so that every
+		// module can use the initial-exec model for it. Without `main`, it
+		// goes to the module of its accessors if they are all in one.
+		std::vector<std::vector<size_t>> partitionThreadLocals(functionPartitions.size());
+		std::vector<bool> keptGlobals(globalIndex, false);
+		{
+			TimedScope scope("thread-local placement", "stage");
+			std::unordered_map<std::string, size_t> partitionOf;
+			{
+				std::vector<llvm::Function *> functions;
+				for (auto &function : loadedModule->functions())
+				{
+					functions.push_back(&function);
+				}
+				for (size_t job = 0; job < functionPartitions.size(); job++)
+				{
+					for (auto functionIndex : functionPartitions[job])
+					{
+						partitionOf[functions[functionIndex]->getName().str()] = job;
+					}
+				}
+			}
+			std::vector<llvm::GlobalVariable *> globals;
+			for (auto &globalVariable : loadedModule->globals())
+			{
+				globals.push_back(&globalVariable);
+			}
+			const size_t mainPartition =
+				std::find(partitionNames.begin(), partitionNames.end(), "main") -
+				partitionNames.begin();
+
+			size_t inMain = 0;
+			size_t withAccessors = 0;
+			auto kept = [&](const std::pair<size_t, std::string> &job)
+			{
+				auto &variable = *globals[job.first];
+				if (!variable.isThreadLocal() || variable.isConstant() ||
+					variable.getName() != job.second)
+				{
+					return false;
+				}
+
+				auto accesses = accessingFunctions(variable);
+				std::set<size_t> accessors;
+				for (const auto &[function, count] : accesses)
+				{
+					accessors.insert(partitionOf.at(function));
+				}
+				size_t home = mainPartition;
+				if (home == partitionNames.size() && accessors.size() == 1)
+				{
+					home = *accessors.begin();
+				}
+
+				const bool placed = home != partitionNames.size();
+				const auto &owner = placed ? partitionNames[home] : job.second;
+				const bool executable = owner == "main";
+				for (const auto &[function, count] : accesses)
+				{
+					const auto &accessor = partitionNames[partitionOf.at(function)];
+					if (accessor != owner)
+					{
+						threadLocalReport.push_back(
+							accessor + " " + function + " " + job.second + " " + owner + " " +
+							std::to_string(count) +
+							(executable ? " initial-exec" : " general-dynamic"));
+						threadLocalCrossings++;
+						threadLocalGeneralDynamic += !executable;
+					}
+				}
+				if (!placed)
+				{
+					return false;
+				}
+
+				partitionThreadLocals[home].push_back(job.first);
+				keptGlobals[job.first] = true;
+				if (executable)
+				{
+					variable.setThreadLocalMode(llvm::GlobalValue::InitialExecTLSModel);
+					inMain++;
+				}
+				else
+				{
+					withAccessors++;
+				}
+				return true;
+			};
+			globalJobs.erase(std::remove_if(globalJobs.begin(), globalJobs.end(), kept),
+							 globalJobs.end());
+			if (inMain + withAccessors > 0)
+			{
+				log << "thread-local: " << inMain << " variables defined in main, "
+						  << withAccessors << " with their accessors\n";
+			}
+		}
+
+		llvm::SmallVector<char, 0> bitcode;
+		if (!options.streaming)
+		{
+			TimedScope scope("write temp.bc", "stage");
+			llvm::raw_svector_ostream bitcodeStream(bitcode);
+			llvm::WriteBitcodeToFile(*loadedModule, bitcodeStream);
+			loadedModule.reset();
+		}
+
+		std::vector<std::unique_ptr<Worker>> workers(pool.size());
+
+		auto loadScope = std::make_unique<TimedScope>("load temp.bc in the workers", "stage");
+		pool.forEachWorker(
+			[&](unsigned index)
+			{
+				TimedScope scope("parse temp.bc", "step", index + 1);
+				auto worker = std::make_unique<Worker>();
+				worker->thread = index + 1;
+				llvm::SMDiagnostic workerErr;
+				if (options.streaming)
+				{
+					worker->module = loadInput(*buffers[input], workerErr, worker->context, true);
+				}
+				else
+				{
+					worker->module = llvm::parseIR(
+						llvm::MemoryBufferRef(llvm::StringRef(bitcode.data(), bitcode.size()),
+											  inputs[input]),
+						workerErr, worker->context);
+				}
+				if (!worker->module)
+				{
+					std::lock_guard<std::mutex> guard(outputMutex);
+					workerErr.print(nullptr, llvm::errs());
+					llvm::report_fatal_error("failed to load the module in a worker");
+				}
+				if (options.streaming)
+				{
+					applyResolution(*worker->module, resolution);
+					publicizeSymbols(*worker->module);
+				}
+				worker->cache = std::make_unique<ConstantOperandCache>(*worker->module);
+				if (options.emit != EmitKind::Bitcode)
+				{
+					worker->targetMachine =
+						createTargetMachine(*worker->module, options.codegenOptLevel);
+				}
+				for (auto &function : worker->module->functions())
+				{
+					worker->functions.push_back(&function);
+				}
+				workers[index] = std::move(worker);
+			});
+		loadScope.reset();
+
+		// Whether each constant global is in the shared constant pool, or
+		// extracted on its own for the other inputs, instead of copied.
+		std::vector<bool> pooled(graph.size(), false);
+		for (auto index : exportedConstants)
+		{
+			pooled[index] = true;
+		}
+		if (options.constantPool)
+		{
+			TimedScope scope("constant pool", "stage");
+			std::vector<std::vector<unsigned>> partitionConstants(functionPartitions.size());
+			pool.run(functionPartitions.size(),
+					 [&](unsigned index, size_t job)
+					 {
+						 auto &worker = *workers[index];
+						 MyPass pass(*worker.cache, graph);
+						 for (auto functionIndex : functionPartitions[job])
+						 {
+							 pass.visit(*worker.functions[functionIndex]);
+						 }
+						 partitionConstants[job] = pass.sortedIndices();
+					 });
+
+			std::vector<unsigned> users(graph.size(), 0);
+			for (const auto &constants : partitionConstants)
+			{
+				for (auto constant : constants)
+				{
+					users[constant]++;
+				}
+			}
+			for (const auto &[global, globName] : globalJobs)
+			{
+				for (auto constant : graph.dependencies(global))
+				{
+					users[constant]++;
+				}
+			}
+
+			// Only the constants the other modules can link against are
+			// shared, hidden ones are still copied into every user. So are the
+			// constants referencing a hidden one, as the pool would only get a
+			// declaration of it, which nothing defines for the pool to link to.
+			auto &worker = *workers.front();
+			auto hidden = [&worker](unsigned node)
+			{
+				auto global = worker.cache->global(node);
+				return global->hasLocalLinkage() || global->hasHiddenVisibility();
+			};
+			const auto &dataLayout = worker.module->getDataLayout();
+			std::vector<llvm::GlobalValue *> values;
+			std::stringstream description;
+			uint64_t poolBytes = 0;
+			uint64_t savedBytes = 0;
+			for (unsigned constant = 0; constant < graph.size(); constant++)
+			{
+				auto global = worker.cache->global(constant);
+				if (pooled[constant] || users[constant] < 2 || hidden(constant))
+				{
+					continue;
+				}
+				const auto dependencies = graph.dependencies(constant);
+				if (std::any_of(dependencies.begin(), dependencies.end(), hidden))
+				{
+					continue;
+				}
+				pooled[constant] = true;
+				values.push_back(global);
+				description << "--glob=" << global->getName().str() << " ";
+
+				auto size = dataLayout.getTypeAllocSize(global->getValueType()).getFixedSize();
+				poolBytes += size;
+				savedBytes += size * (users[constant] - 1);
+			}
+
+			log << "constant pool: " << values.size() << " constants, " << poolBytes
+					  << " bytes, " << savedBytes << " bytes of copies removed\n";
+			if (!values.empty())
+			{
+				emit(worker, values, "constant.pool" + inputSuffix, description);
+			}
+		}
+
+		// With --data-modules, the groups of mutable globals extracted
+		// together instead of on their own.
+		std::vector<bool> placed(graph.size(), false);
+		std::vector<std::vector<unsigned>> dataGroups;
+		if (options.dataModules)
+		{
+			TimedScope scope("data placement", "stage");
+			std::vector<std::unordered_map<unsigned, uint64_t>> partitionVariables(
+				functionPartitions.size());
+			pool.run(functionPartitions.size(),
+					 [&](unsigned index, size_t job)
+					 {
+						 auto &worker = *workers[index];
+						 MyPass pass(*worker.cache, graph, true);
+						 for (auto functionIndex : functionPartitions[job])
+						 {
+							 pass.visit(*worker.functions[functionIndex]);
+						 }
+						 partitionVariables[job] = std::move(pass.variableAccesses);
+					 });
+
+			// Only the variables stage 2 would extract on their own are
+			// placed; the thread-local ones are not in the data pages.
+			auto &worker = *workers.front();
+			const auto &dataLayout = worker.module->getDataLayout();
+			std::vector<uint64_t> sizes(graph.size(), 0);
+			std::vector<unsigned> candidates;
+			for (const auto &[global, globName] : globalJobs)
+			{
+				auto variable = worker.cache->global(global);
+				if (variable->isConstant() || variable->isThreadLocal() ||
+					variable->getName() != globName)
+				{
+					continue;
+				}
+				candidates.push_back(global);
+				sizes[global] = llvm::alignTo(
+					dataLayout.getTypeAllocSize(variable->getValueType()).getFixedSize(),
+					dataLayout.getPreferredAlign(variable));
+			}
+
+			DataPlacement placement(sizes);
+			for (const auto &variables : partitionVariables)
+			{
+				placement.addModule(variables);
+			}
+			dataGroups = placement.place(candidates, options.dataModuleSize);
+
+			const uint64_t pageSize = 4096;
+			size_t variableCount = 0;
+			uint64_t pagesBefore = 0;
+			uint64_t pagesAfter = 0;
+			for (const auto &group : dataGroups)
+			{
+				for (auto global : group)
+				{
+					placed[global] = true;
+					pagesBefore += placement.pages({global}, pageSize);
+				}
+				variableCount += group.size();
+				pagesAfter += placement.pages(group, pageSize);
+			}
+			log << "data modules: " << variableCount << " of " << candidates.size()
+					  << " variables in " << dataGroups.size() << " modules, "
+					  << variableCount - dataGroups.size() << " fewer mappings and "
+					  << pagesBefore - pagesAfter << " fewer data pages\n";
+		}
+
+		/**
+		 * This is the second stage.
+		 *
+		 * Here we find all of the globals that are suitable for
+		 * moving and extract each of them into its own module.
+		 */
+		auto globalsScope = std::make_unique<TimedScope>("stage 2: extract globals", "stage");
+		pool.run(globalJobs.size(),
+				 [&](unsigned index, size_t job)
+				 {
+					 if (placed[globalJobs[job].first])
+					 {
+						 return;
+					 }
+					 auto &worker = *workers[index];
+					 auto &globalVariable = *worker.cache->global(globalJobs[job].first);
+					 const auto &globName = globalJobs[job].second;
+					 TimedScope scope(globName, "job", worker.thread, globName);
+
+					 std::stringstream description;
+					 description << getFileName(globalVariable) << "\n";
+
+					 auto extractedGlobal = worker.module->getNamedGlobal(globName);
+					 if (!extractedGlobal)
+					 {
+						 std::lock_guard<std::mutex> guard(outputMutex);
+						 llvm::errs() << "program doesn't contain global named '" << globName
+									  << "'!\n";
+						 writeFailed = true;
+						 return;
+					 }
+
+					 std::vector<llvm::GlobalValue *> values = {extractedGlobal};
+					 description << "--glob=" << globName << " ";
+
+					 for (const auto dependency : graph.dependencies(globalJobs[job].first))
+					 {
+						 if (pooled[dependency])
+						 {
+							 continue;
+						 }
+						 values.push_back(worker.cache->global(dependency));
+						 description << "--glob=" << values.back()->getName().str() << " ";
+					 }
+
+					 emit(worker, values, globName, description);
+				 });
+
+		pool.run(dataGroups.size(),
+				 [&](unsigned index, size_t job)
+				 {
+					 auto &worker = *workers[index];
+					 const auto name = "data" + inputSuffix + "." + std::to_string(job);
+					 TimedScope scope(name, "job", worker.thread, name);
+
+					 std::stringstream description;
+					 std::vector<llvm::GlobalValue *> values;
+					 for (auto global : dataGroups[job])
+					 {
+						 values.push_back(worker.cache->global(global));
+						 description << "--glob=" << values.back()->getName().str() << " ";
+					 }
+
+					 std::set<unsigned> dependencies;
+					 for (auto global : dataGroups[job])
+					 {
+						 for (const auto dependency : graph.dependencies(global))
+						 {
+							 if (!pooled[dependency])
+							 {
+								 dependencies.insert(dependency);
+							 }
+						 }
+					 }
+					 for (auto dependency : dependencies)
+					 {
+						 values.push_back(worker.cache->global(dependency));
+						 description << "--glob=" << values.back()->getName().str() << " ";
+					 }
+
+					 emit(worker, values, name, description, true);
+				 });
+
+		globalsScope.reset();
+
+		{
+			TimedScope scope("stage 3: declare moved globals", "stage");
+			pool.forEachWorker([&](unsigned index)
+							   { declareMovedGlobals(*workers[index]->module, keptGlobals); });
+		}
+
+		/**
+		 * This is the fourth and final stage.
+		 *
+		 * All of the functions are iterated and each of them (or each group
+		 * of them, when partitioning) is extracted together with the
+		 * constants it references.
+		 */
+		auto functionsScope = std::make_unique<TimedScope>("stage 4: extract functions", "stage");
+		pool.run(functionPartitions.size(),
+				 [&](unsigned index, size_t job)
+				 {
+					 MemoryThrottle::Job throttled(throttle);
+					 auto &worker = *workers[index];
+					 const auto &partition = functionPartitions[job];
+
+					 std::stringstream description;
+					 std::vector<llvm::GlobalValue *> values;
+					 MyPass pass(*worker.cache, graph);
+					 const auto &name = partitionNames[job];
+					 TimedScope scope(name, "job", worker.thread, name);
+
+					 auto resolveScope = std::make_unique<TimedScope>(
+						 "resolve dependencies", "step", worker.thread);
+					 for (auto functionIndex : partition)
+					 {
+						 auto &function = *worker.functions[functionIndex];
+						 if (auto error = function.materialize())
+						 {
+							 std::lock_guard<std::mutex> guard(outputMutex);
+							 llvm::errs() << function.getName() << ": "
+										  << llvm::toString(std::move(error)) << "\n";
+							 writeFailed = true;
+							 return;
+						 }
+						 description << "filename: " << getFileName(function) << "\n";
+						 pass.visit(function);
+						 values.push_back(&function);
+					 }
+					 worker.naiveVisits += pass.naiveVisits;
+					 resolveScope.reset();
+
+					 for (auto const &function : values)
+					 {
+						 description << "--func=" << function->getName().str() << " ";
+					 }
+
+					 for (auto const &use : pass.sortedGlobals())
+					 {
+						 if (pooled[worker.cache->index(use)])
+						 {
+							 continue;
+						 }
+						 values.push_back(use);
+						 description << "--glob=" << use->getName().str() << " ";
+					 }
+					 for (auto global : partitionThreadLocals[job])
+					 {
+						 values.push_back(worker.cache->global(global));
+						 description << "--glob=" << values.back()->getName().str() << " ";
+					 }
+
+					 emit(worker, values, name, description);
+
+					 // Every function is extracted once, so its body is not
+					 // needed anymore, the other modules only declare it.
+					 if (options.streaming)
+					 {
+						 for (auto functionIndex : partition)
+						 {
+							 worker.functions[functionIndex]->deleteBody();
+						 }
+					 }
+				 });
+
+		functionsScope.reset();
+
+		if (options.lazyStubs && !options.dry)
+		{
+			TimedScope scope("lazy stubs", "stage");
+			auto &worker = *workers.front();
+			auto stubs = buildLazyStubs(*worker.module, lazyLibraries);
+			if (options.exportLists)
+			{
+				// The stubs find the functions with dlsym.
+				auto symbols = collectSymbols(*stubs);
+				for (const auto &[function, library] : lazyLibraries)
+				{
+					symbols.imports.push_back(function);
+				}
+				moduleSymbols["lazy.stubs"] = std::move(symbols);
+			}
+			if (options.archive)
+			{
+				std::string data;
+				llvm::raw_string_ostream dataStream(data);
+				llvm::WriteBitcodeToFile(*stubs, dataStream);
+				archiveWriter.add("_lazy.stubs.bc", std::move(dataStream.str()));
+			}
+			else if (!writeBitcode(*stubs, options.outputDirectory + "/_lazy.stubs.bc"))
+			{
+				writeFailed = true;
+			}
+			manifest.record(manifest.moduleEntry("_lazy.stubs.bc"));
+			if (options.emit != EmitKind::Bitcode &&
+				!writeObject(*worker.targetMachine, *stubs,
+							 options.outputDirectory + "/_lazy.stubs.o"))
+			{
+				writeFailed = true;
+			}
+
+			std::sort(eagerModules.begin(), eagerModules.end());
+			std::string flags;
+			for (const auto &name : eagerModules)
+			{
+				flags += "-l_" + name + "\n";
+			}
+			if (!writeIfChanged(options.outputDirectory + "/lazy-link.flags", flags))
+			{
+				writeFailed = true;
+			}
+			manifest.record("lazy-link.flags");
+			log << "lazy stubs: " << lazyLibraries.size() << " functions in "
+					  << lazyModules.size() << " libraries loaded on demand, "
+					  << eagerModules.size() << " libraries linked\n";
+		}
+
+		graphSize += graph.size();
+		graphEdges += graph.edgeCount();
+		graphComponents += graph.componentCount();
+		addVisits(operandVisits, graphCache.operandVisits);
+		for (const auto &worker : workers)
+		{
+			addVisits(operandVisits, worker->cache->operandVisits);
+			addVisits(naiveVisits, worker->naiveVisits);
+		}
+	}
+
+	if (options.compact && !options.dry)
+	{
+		log << "compact: " << bytesBeforeCompact << " -> " << bytesAfterCompact
+				  << " bytes of bitcode in the " << extractedCount << " extracted modules\n";
+	}
+
+	if (options.exportLists && !options.dry)
+	{
+		TimedScope scope("export lists", "stage");
+		size_t defined = 0;
+		for (const auto &[name, symbols] : moduleSymbols)
+		{
+			defined += symbols.definitions.size();
+		}
+		std::unordered_set<std::string> changedScripts;
+		auto exported =
+			writeExportLists(options.outputDirectory, moduleSymbols, manifest, changedScripts);
+		if (exported)
+		{
+			log << "export lists: " << *exported << " of " << defined
+					  << " defined symbols exported\n";
+		}
+		else
+		{
+			writeFailed = true;
+		}
+
+		std::vector<std::string> links;
+		for (const auto &[name, needed] : deferredLinks)
+		{
+			if (exported && (needed || changedScripts.count(name) != 0))
+			{
+				links.push_back(name);
+			}
+		}
+		pool.run(links.size(),
+				 [&](unsigned index, size_t job)
+				 {
+					 const auto &name = links[job];
+					 TimedScope scope("link " + name, "job", index + 1, name);
+					 if (!linkSharedLibrary(options, options.outputDirectory + "/_" + name + ".o",
+											options.outputDirectory + "/lib_" + name + ".so",
+											options.outputDirectory + "/_" + name + ".exports"))
+					 {
+						 writeFailed = true;
+					 }
+				 });
+	}
+
+	if (options.leafCloneSize > 0 && !options.dry)
+	{
+		log << "clone leaves: " << leafCopies << " copies of " << clonedLeaves.size()
+				  << " functions, " << leafInstructions << " instructions added, " << leafCalls
+				  << " calls to other modules removed\n";
+	}
+
+	if (threadLocalCrossings > 0)
+	{
+		log << "thread-local: " << threadLocalCrossings
+				  << " functions access a variable of another module, "
+				  << threadLocalGeneralDynamic << " of them with the general-dynamic model\n";
+	}
+	if (!options.dry)
+	{
+		std::sort(threadLocalReport.begin(), threadLocalReport.end());
+		std::string report;
+		for (const auto &line : threadLocalReport)
+		{
+			report += line + "\n";
+		}
+		if ((!report.empty() ||
+			 std::filesystem::exists(options.outputDirectory + "/tls-accesses.txt")) &&
+			!writeIfChanged(options.outputDirectory + "/tls-accesses.txt", report))
+		{
+			writeFailed = true;
+		}
+	}
+
+	if (!options.dry && extractedCount > 0)
+	{
+		log << "local references: " << localReferences
+				  << " definitions used within their own module made dso_local\n";
+	}
+
+	if (options.callTables && !options.dry)
+	{
+		log << "call tables: " << tableCalls << " calls to other modules redirected\n";
+	}
+
+	if (!options.dry && options.archive)
+	{
+		TimedScope scope("write archive", "stage");
+		previousArchive.reset();
+		llvm::SmallVector<char, 0> contents;
+		llvm::raw_svector_ostream contentsStream(contents);
+		archiveWriter.write(contentsStream);
+		if (!writeIfChanged(archivePath, llvm::StringRef(contents.data(), contents.size())))
+		{
+			return false;
+		}
+		manifest.record("split.archive");
+		log << "archive: " << archiveWriter.size() << " modules, " << contents.size()
+				  << " bytes\n";
+	}
+
+	if (!options.dry)
+	{
+		TimedScope scope("save manifest", "stage");
+		auto removed = manifest.save();
+		log << "manifest: " << extractedCount << " extracted, " << unchangedCount
+				  << " unchanged, " << removed << " removed\n";
+	}
+
+	log << "dependency graph: " << graphSize << " globals, " << graphEdges << " edges, "
+			  << graphComponents << " components; operand visits: "
+			  << operandVisits << " performed, "
+			  << (naiveVisits > operandVisits ? naiveVisits - operandVisits : 0) << " saved\n";
+
+	if (throttle.waited() > 0)
+	{
+		log << "streaming: " << throttle.waited()
+				  << " jobs waited for memory to stay under --max-rss\n";
+	}
+	if (options.streaming && options.maxRss > 0 && peakRss() > options.maxRss * 1024)
+	{
+		llvm::errs() << "warning: the peak resident memory, " << peakRss() / 1024
+					 << " MiB, went over --max-rss\n";
+	}
+
+	if (options.timeReport)
+	{
+		timeline.printReport(log);
+	}
+	if (!options.traceFile.empty() && !timeline.writeTrace(options.traceFile, pool.size()))
+	{
+		return false;
+	}
+	return !writeFailed;
+}
+
+bool splitFiles(const std::vector<std::string> &inputs, const Options &options)
+{
+	std::vector<std::unique_ptr<llvm::MemoryBuffer>> buffers;
+	for (const auto &input : inputs)
+	{
+		auto buffer = llvm::MemoryBuffer::getFileOrSTDIN(input);
+		if (!buffer)
+		{
+			llvm::errs() << input << ": " << buffer.getError().message() << "\n";
+			return false;
+		}
+		buffers.push_back(std::move(*buffer));
+	}
+	return run(buffers, options);
+}
+
+bool splitModule(const llvm::Module &module, const Options &options)
+{
+	llvm::SmallVector<char, 0> bitcode;
+	llvm::raw_svector_ostream bitcodeStream(bitcode);
+	llvm::WriteBitcodeToFile(module, bitcodeStream);
+
+	std::vector<std::unique_ptr<llvm::MemoryBuffer>> buffers;
+	buffers.push_back(llvm::MemoryBuffer::getMemBuffer(
+		llvm::StringRef(bitcode.data(), bitcode.size()), module.getModuleIdentifier(), false));
+	return run(buffers, options);
+}
+
+llvm::PreservedAnalyses FunctionSplitPass::run(llvm::Module &module,
+											   llvm::ModuleAnalysisManager &)
+{
+	if (!splitModule(module, options))
+	{
+		module.getContext().emitError("function-split: the module could not be split");
+	}
+	return llvm::PreservedAnalyses::all();
+}
+
+} // namespace functionSplit
@@ -0,0 +1,129 @@
+/*
+ * The function splitter as a library: the stages of split-llvm-extract
+ * (publicizing the symbols, extracting the globals, declaring the moved
+ * globals and extracting the functions with the constants they depend
+ * on), run on bitcode files or on a module in memory, so that they can
+ * also run inside a pass pipeline (see FunctionSplitPass) without
+ * writing the whole program out first.
+ *
+ * split-llvm-extract is the command line front end of this library, so
+ * both give the same modules for the same input and options: `_main.bc`
+ * holds `main`, and every other function and global variable gets its
+ * own `_<name>.bc` module (unless grouped), each of which can be compiled
+ * to a shared library with tests/Makefile.
+ */
+
+#ifndef FUNCTION_SPLIT_H
+#define FUNCTION_SPLIT_H
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <llvm/IR/Module.h>
+#include <llvm/IR/PassManager.h>
+
+namespace functionSplit
+{
+
+enum class EmitKind
+{
+	Bitcode,
+	Object,
+	SharedLibrary
+};
+
+/**
+ * How to split, with the defaults of split-llvm-extract. The README
+ * describes every option, under the name split-llvm-extract gives it.
+ */
+struct Options
+{
+	// -o: where the modules are written.
+	std::string outputDirectory = ".";
+	// -d: run without writing any of the split modules.
+	bool dry = false;
+	// -j: the number of worker threads, or 0 for one per core.
+	unsigned jobs = 0;
+	// -f: extract every module, even if the manifest says it is unchanged.
+	bool force = false;
+
+	// --partitions, --max-partition-size, --use-profile-metadata, --profile
+	// and --hot-fraction: how the functions are grouped into modules.
+	unsigned partitions = 0;
+	uint64_t maxPartitionSize = 0;
+	bool useProfileMetadata = false;
+	std::string profileFile;
+	double hotFraction = 0.99;
+
+	// --emit, --codegen-opt-level, --linker and --linker-flag: what is
+	// generated besides the bitcode, and how.
+	EmitKind emit = EmitKind::Bitcode;
+	unsigned codegenOptLevel = 2;
+	std::string linker = "clang";
+	std::vector<std::string> linkerFlags;
+
+	bool archive = false;
+	bool constantPool = false;
+	bool dataModules = false;
+	uint64_t dataModuleSize = 4096;
+	unsigned leafCloneSize = 0;
+	bool compact = false;
+	bool stripDebug = false;
+	bool callTables = false;
+	bool lazyStubs = false;
+	bool exportLists = false;
+	bool streaming = false;
+	// --max-rss, in MiB.
+	uint64_t maxRss = 0;
+
+	bool timeReport = false;
+	std::string traceFile;
+
+	/**
+	 * Where what every module is extracted from and the statistics of
+	 * the split are reported, or nowhere if null. The errors always go to
+	 * the standard error.
+	 */
+	std::ostream *log = nullptr;
+};
+
+/**
+ * Split the bitcode (or textual IR) files `inputs` together, as
+ * described in `options`.
+ *
+ * @return Whether every module was extracted and written. If not, the
+ * errors were printed.
+ */
+bool splitFiles(const std::vector<std::string> &inputs, const Options &options);
+
+/**
+ * Split `module` as `splitFiles` splits a single input. `module` is not
+ * modified.
+ *
+ * @return Whether every module was extracted and written.
+ */
+bool splitModule(const llvm::Module &module, const Options &options);
+
+/**
+ * The new pass manager pass, registered as `function-split` by the
+ * plugin built from function-split-plugin.cpp. It writes the split
+ * modules and leaves the module it runs on unchanged.
+ */
+class FunctionSplitPass : public llvm::PassInfoMixin<FunctionSplitPass>
+{
+  public:
+	explicit FunctionSplitPass(Options options) : options(std::move(options))
+	{
+	}
+
+	llvm::PreservedAnalyses run(llvm::Module &module, llvm::ModuleAnalysisManager &);
+
+  private:
+	Options options;
+};
+
+} // namespace functionSplit
+
+#endif
@@ -1,231 +1,150 @@
-#include <algorithm>
-#include <execution>
+#include "split-partition.h"
+
+#include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <memory>
-#include <pstl/glue_execution_defs.h>
 #include <string>
-#include <system_error>
-
-#include <llvm/ADT/SmallVector.h>
-#include <llvm/ADT/StringExtras.h>
-#include <llvm/ADT/StringRef.h>
-#include <llvm/Bitcode/BitcodeWriter.h>
-#include <llvm/IR/Argument.h>
-#include <llvm/IR/DerivedTypes.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
 #include <llvm/IR/Function.h>
 #include <llvm/IR/GlobalValue.h>
-#include <llvm/IR/Instructions.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/IRReader/IRReader.h>
-#include <llvm/Support/Casting.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/SourceMgr.h>
 #include <llvm/Support/raw_ostream.h>
-#include <llvm/Transforms/Utils/Cloning.h>
-#include <llvm/Transforms/Utils/ValueMapper.h>
 
 static llvm::LLVMContext context;
 
-enum FunctionAction
-{
-	MakePublic,
-	Skip,
-	MakePrivate,
-	MakeRefernce
-};
+llvm::SMDiagnostic err;
 
-static void copyComdat(const llvm::GlobalObject *source, llvm::GlobalObject *destination)
-{
-	if (const auto *comdat = source->getComdat())
-	{
-		auto *newComdat = destination->getParent()->getOrInsertComdat(comdat->getName());
-		newComdat->setSelectionKind(comdat->getSelectionKind());
-		destination->setComdat(newComdat);
-	}
-}
+llvm::cl::opt<std::string> InputFilename(llvm::cl::Positional, llvm::cl::desc("<input file>"));
 
-void moveFunctions(const llvm::StringRef outputName, const llvm::Module *module,
-				   FunctionAction(CheckFunction)(const llvm::Module &, const llvm::Function &))
+llvm::cl::opt<std::string> OutputDirectory("o",
+										   llvm::cl::desc("Where the partitions are written."),
+										   llvm::cl::init("."));
+
+llvm::cl::opt<unsigned> Partitions("partitions",
+								   llvm::cl::desc("Split the functions into this many modules, "
+												  "in the order they are defined."));
+
+llvm::cl::opt<std::string>
+	AssignmentFile("assign",
+				   llvm::cl::desc("A file with a `<symbol> <module>` line per symbol. The "
+								  "symbols it does not list go to the first module."),
+				   llvm::cl::value_desc("filename"));
+
+llvm::cl::opt<unsigned> Jobs("j", llvm::cl::desc("Number of threads writing the modules."),
+							 llvm::cl::init(std::max(1u, std::thread::hardware_concurrency())));
+
+llvm::cl::opt<bool> Verbose("v", llvm::cl::desc("Print the resulting modules."));
+
+/**
+ * Read the partition of each symbol from `path`, adding the modules to
+ * `names` in the order they first appear.
+ *
+ * @return The partition of each symbol listed.
+ */
+std::unordered_map<std::string, unsigned> readAssignment(const std::string &path,
+														 std::vector<std::string> &names)
 {
-	llvm::Module result(outputName, context);
-
-	result.setDataLayout(module->getDataLayout());
-	result.setTargetTriple(module->getTargetTriple());
-	result.setModuleInlineAsm(module->getModuleInlineAsm());
-
-	/*
-	  The value to value map is the central datastructure to the function
-	  cloning/moving. It is used to map the llvm values that reside in the
-	  original module to the ones that reside in the new resutling module module.
-	*/
-	llvm::ValueToValueMapTy vMap;
-
-	// Move the global values over, as they are used even when no gobal values are
-	// present in the code, for things like string literals.
-	for (const auto &global : module->globals())
+	std::unordered_map<std::string, unsigned> table;
+	std::unordered_map<std::string, unsigned> partitions;
+	std::ifstream input(path);
+	std::string symbol;
+	std::string name;
+	while (input >> symbol >> name)
 	{
-		std::cout << global.getName().str() << std::endl;
-
-		auto resultGlobal = new llvm::GlobalVariable(
-			result, global.getValueType(), global.isConstant(), global.getLinkage(), nullptr,
-			global.getName(), nullptr, global.getThreadLocalMode(),
-			global.getType()->getAddressSpace());
-
-		// TODO: Find a way to understand how CloneModule copies these things
-		// without calling this functions.
-		resultGlobal->setAlignment(global.getAlign());
-		resultGlobal->setUnnamedAddr(global.getUnnamedAddr());
-
-		vMap[&global] = resultGlobal;
-
-		llvm::SmallVector<std::pair<unsigned, llvm::MDNode *>, 1> metadataList;
-		global.getAllMetadata(metadataList);
-		for (auto [kind, node] : metadataList)
+		auto [found, added] = partitions.emplace(name, names.size());
+		if (added)
 		{
-			resultGlobal->addMetadata(
-				kind, *MapMetadata(node, vMap, llvm::RemapFlags::RF_ReuseAndMutateDistinctMDs));
+			names.push_back(name + ".bc");
 		}
+		table[symbol] = found->second;
+	}
+	return table;
+}
 
-		if (global.hasInitializer())
-		{
-			resultGlobal->setInitializer(MapValue(global.getInitializer(), vMap));
-		}
+int main(int argc, char **argv)
+{
+	llvm::cl::ParseCommandLineOptions(argc, argv);
 
-		copyComdat(&global, resultGlobal);
+	auto file = InputFilename.getValue();
+	std::unique_ptr<llvm::Module> m = llvm::parseIRFile(file, err, context);
+	if (!m)
+	{
+		err.print(file.c_str(), llvm::outs());
+		return 1;
 	}
 
-	// Go through all the functions and create the declarations without
-	// bodies so they can be linked against when copying the bodies later.
-	for (const llvm::Function &function : module->functions())
+	std::vector<std::string> names;
+	splitPartition::Assignment assign;
+	if (AssignmentFile.getNumOccurrences() != 0)
 	{
-		auto action = CheckFunction(result, function);
-		if (action == FunctionAction::Skip)
+		assign = splitPartition::fromTable(readAssignment(AssignmentFile, names), 0);
+		if (names.empty())
 		{
-			continue;
+			names.push_back("main.bc");
 		}
-
-		auto resultFunction =
-			llvm::Function::Create(llvm::cast<llvm::FunctionType>(function.getValueType()),
-								   function.getLinkage(), function.getName(), result);
-
-		vMap[&function] = resultFunction;
 	}
-
-	// Now copy all of the functions bodies and meta-data.
-	for (const llvm::Function &function : module->functions())
+	else if (Partitions != 0)
 	{
-		auto action = CheckFunction(result, function);
-		if (action == FunctionAction::Skip)
+		// Consecutive functions stay together, as they often call each other.
+		std::unordered_map<std::string, unsigned> table;
+		size_t definitions = 0;
+		for (const auto &function : m->functions())
 		{
-			continue;
+			definitions += !function.isDeclaration();
 		}
-
-		auto resultFunction = llvm::cast<llvm::Function>(vMap[&function]);
-
-		auto resultArg = resultFunction->arg_begin();
-		for (const auto &arg : function.args())
+		size_t index = 0;
+		for (const auto &function : m->functions())
 		{
-			resultArg->setName(arg.getName());
-			vMap[&arg] = &*resultArg++;
+			if (!function.isDeclaration())
+			{
+				table[function.getName().str()] = index++ * Partitions / definitions;
+			}
 		}
-
-		llvm::SmallVector<llvm::ReturnInst *, 8> returns;
-		if (action != FunctionAction::MakeRefernce)
+		for (unsigned part = 0; part < Partitions; part++)
 		{
-			llvm::CloneFunctionInto(resultFunction, &function, vMap,
-									llvm::CloneFunctionChangeType::DifferentModule, returns);
-		}
-		resultFunction->copyAttributesFrom(&function);
-		copyComdat(&function, resultFunction);
-
-		if (action == MakePrivate)
-		{
-			resultFunction->setLinkage(llvm::GlobalValue::ExternalLinkage);
-			resultFunction->setVisibility(llvm::GlobalValue::VisibilityTypes::HiddenVisibility);
+			names.push_back("partition." + std::to_string(part) + ".bc");
 		}
+		assign = splitPartition::fromTable(std::move(table), 0);
 	}
-
-	std::error_code ec;
-	llvm::raw_fd_ostream OS(outputName, ec);
-	result.print(llvm::outs(), nullptr);
-
-	if (llvm::verifyModule(result, &llvm::outs(), nullptr))
+	else
 	{
-		llvm::WriteBitcodeToFile(result, OS);
+		// TODO: These definitions would come from some file describing them
+		// or would be constructed automatically.
+		names = {"main.bc", "lib.bc"};
+		assign = splitPartition::fromTable({{"a", 1}, {"b", 1}, {"cc", 1}}, 0);
 	}
-}
-
-llvm::SMDiagnostic err;
-
-llvm::cl::opt<std::string> InputFilename(llvm::cl::Positional, llvm::cl::desc("<input file>"));
-
-int main(int argc, char **argv)
-{
-	llvm::cl::ParseCommandLineOptions(argc, argv);
 
-	auto file = InputFilename.getValue();
-	std::cout << file << std::endl;
-	std::unique_ptr<llvm::Module> um = llvm::parseIRFile(file, err, context);
-	const llvm::Module *m = um.get();
-	m->print(llvm::outs(), nullptr);
+	auto partitions = splitPartition::partition(*m, names, assign);
 
-	// Show that the CloneModule function works fine, for all inputs.
-	auto cloned = llvm::CloneModule(*m);
-	cloned.get()->print(llvm::outs(), nullptr);
-
-	if (m)
+	std::vector<std::string> paths;
+	for (unsigned part = 0; part < partitions.size(); part++)
 	{
-		// TODO: These definitions would come from some file describing them
-		// or would be constructed automatically.
-		moveFunctions("lib.bc", m,
-					  [](auto module, const llvm::Function &function) -> FunctionAction
-					  {
-						  if (function.getName().equals("a"))
-						  {
-							  return FunctionAction::MakePrivate;
-						  }
-						  else if (function.getName().equals("b"))
-						  {
-							  return FunctionAction::MakePublic;
-						  }
-						  else if (function.getName().equals("cc"))
-						  {
-							  return FunctionAction::MakePublic;
-						  }
-						  else
-						  {
-							  return FunctionAction::Skip;
-						  }
-					  });
-
-		moveFunctions("main.bc", m,
-					  [](auto module, const llvm::Function &function) -> FunctionAction
-					  {
-						  if (function.getName().equals("b"))
-						  {
-							  return FunctionAction::MakeRefernce;
-						  }
-						  else if (function.getName().equals("cc"))
-						  {
-							  return FunctionAction::MakeRefernce;
-						  }
-						  else if (function.getName().equals("main"))
-						  {
-							  return FunctionAction::MakePublic;
-						  }
-						  else if (function.getName().equals("printf"))
-						  {
-							  return FunctionAction::MakeRefernce;
-						  }
-						  else
-						  {
-							  return FunctionAction::Skip;
-						  }
-					  });
+		if (Verbose)
+		{
+			partitions[part]->print(llvm::outs(), nullptr);
+		}
+		if (llvm::verifyModule(*partitions[part], &llvm::errs()))
+		{
+			llvm::errs() << names[part] << ": the partition is not valid\n";
+			return 1;
+		}
+		paths.push_back(OutputDirectory + "/" + names[part]);
 	}
-	else
+
+	std::filesystem::create_directories(OutputDirectory.c_str());
+	std::string error;
+	if (!splitPartition::write(partitions, paths, Jobs, error))
 	{
-		err.print(file.c_str(), llvm::outs());
+		llvm::errs() << error << "\n";
+		return 1;
 	}
+	std::cout << partitions.size() << " modules written to " << OutputDirectory << std::endl;
 }
@@ -0,0 +1,90 @@
+/*
+ * A program that lists or unpacks the modules in a split archive
+ * (see split-archive.h), for the tools which expect one `_<name>.bc`
+ * file per module.
+ */
+
+#include "split-archive.h"
+
+#include <filesystem>
+#include <iostream>
+#include <string>
+
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+
+llvm::cl::opt<std::string> archiveFilename(llvm::cl::Positional, llvm::cl::desc("<archive>"),
+										   llvm::cl::Required);
+
+llvm::cl::list<std::string> moduleNames(llvm::cl::Positional,
+										llvm::cl::desc("[<module>...] (default: all of them)"));
+
+llvm::cl::opt<std::string> outputDirectory("o",
+										   llvm::cl::desc("Where the modules are unpacked."),
+										   llvm::cl::init("."));
+
+llvm::cl::opt<bool> list("l", llvm::cl::desc("List the modules instead of unpacking them."));
+
+int main(int argc, char **argv)
+{
+	llvm::cl::ParseCommandLineOptions(argc, argv);
+
+	std::string error;
+	auto reader = splitArchive::Reader::open(archiveFilename, error);
+	if (!reader)
+	{
+		llvm::errs() << error << "\n";
+		return 1;
+	}
+
+	std::vector<splitArchive::Entry> entries;
+	if (moduleNames.empty())
+	{
+		for (size_t index = 0; index < reader->size(); index++)
+		{
+			entries.push_back(reader->entry(index));
+		}
+	}
+	for (const auto &name : moduleNames)
+	{
+		auto entry = reader->find(name);
+		if (!entry)
+		{
+			llvm::errs() << archiveFilename << ": no module named '" << name << "'\n";
+			return 1;
+		}
+		entries.push_back(*entry);
+	}
+
+	if (list)
+	{
+		for (const auto &entry : entries)
+		{
+			llvm::outs() << entry.name << " " << entry.data.size() << " "
+						 << llvm::format_hex_no_prefix(entry.hash, 16) << "\n";
+		}
+		return 0;
+	}
+
+	std::filesystem::create_directories(outputDirectory.c_str());
+	for (const auto &entry : entries)
+	{
+		if (splitArchive::hash(entry.data) != entry.hash)
+		{
+			llvm::errs() << archiveFilename << ": " << entry.name << " is corrupted\n";
+			return 1;
+		}
+
+		const auto path = outputDirectory + "/" + entry.name.str();
+		std::error_code ecode;
+		llvm::raw_fd_ostream output(path, ecode);
+		if (ecode)
+		{
+			llvm::errs() << path << ": " << ecode.message() << "\n";
+			return 1;
+		}
+		output << entry.data;
+	}
+	std::cout << entries.size() << " modules unpacked to " << outputDirectory << std::endl;
+}
@@ -0,0 +1,258 @@
+/*
+ * The split archive: a single file holding the bitcode of many split
+ * modules, written by `split-llvm-extract --archive` instead of one
+ * `_<name>.bc` file per module.
+ *
+ * Layout, with every integer little endian:
+ *
+ *   header   "SPLITARC", u32 version, u32 entry count
+ *   index    one entry per module, sorted by name:
+ *            u64 name offset, u64 name length,
+ *            u64 data offset, u64 data length, u64 hash
+ *   names    the names of the modules, back to back
+ *   data     the bitcode of the modules, each aligned to 8 bytes
+ *
+ * Offsets are from the start of the file, and the hash is the low
+ * 64 bits of the MD5 of the bitcode. As the index is sorted and has
+ * fixed size entries, a module is found with a binary search on the
+ * mapped file, without reading any of the other modules.
+ */
+
+#ifndef SPLIT_ARCHIVE_H
+#define SPLIT_ARCHIVE_H
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <llvm/ADT/Optional.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Endian.h>
+#include <llvm/Support/EndianStream.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+namespace splitArchive
+{
+
+const char magic[8] = {'S', 'P', 'L', 'I', 'T', 'A', 'R', 'C'};
+const uint32_t version = 1;
+const size_t headerSize = 16;
+const size_t entrySize = 40;
+const size_t alignment = 8;
+
+/**
+ * @return The low 64 bits of the MD5 of `data`.
+ */
+inline uint64_t hash(llvm::StringRef data)
+{
+	llvm::MD5 md5;
+	md5.update(data);
+	llvm::MD5::MD5Result result;
+	md5.final(result);
+	return result.low();
+}
+
+struct Entry
+{
+	llvm::StringRef name;
+	llvm::StringRef data;
+	uint64_t hash;
+};
+
+/**
+ * A read-only view of an archive. The file is memory mapped, so only
+ * the pages of the index and of the modules actually read are loaded.
+ */
+class Reader
+{
+  public:
+	/**
+	 * @return The archive at `path`, or nullptr (with the reason in
+	 * `error`) if it cannot be read or is not a valid archive.
+	 */
+	static std::unique_ptr<Reader> open(const std::string &path, std::string &error)
+	{
+		auto buffer = llvm::MemoryBuffer::getFile(path, false, false);
+		if (!buffer)
+		{
+			error = path + ": " + buffer.getError().message();
+			return nullptr;
+		}
+
+		std::unique_ptr<Reader> reader(new Reader(std::move(*buffer)));
+		if (!reader->validate())
+		{
+			error = path + ": not a valid split archive";
+			return nullptr;
+		}
+		return reader;
+	}
+
+	size_t size() const
+	{
+		return count;
+	}
+
+	Entry entry(size_t index) const
+	{
+		const char *base = contents().data() + headerSize + index * entrySize;
+		auto field = [base](size_t number)
+		{ return llvm::support::endian::read64le(base + number * 8); };
+		return {contents().substr(field(0), field(1)), contents().substr(field(2), field(3)),
+				field(4)};
+	}
+
+	/**
+	 * @return The module called `name`, found with a binary search of
+	 * the index.
+	 */
+	llvm::Optional<Entry> find(llvm::StringRef name) const
+	{
+		size_t low = 0;
+		size_t high = count;
+		while (low < high)
+		{
+			auto middle = low + (high - low) / 2;
+			auto candidate = entry(middle);
+			if (candidate.name == name)
+			{
+				return candidate;
+			}
+			if (candidate.name < name)
+			{
+				low = middle + 1;
+			}
+			else
+			{
+				high = middle;
+			}
+		}
+		return llvm::None;
+	}
+
+  private:
+	std::unique_ptr<llvm::MemoryBuffer> buffer;
+	size_t count = 0;
+
+	explicit Reader(std::unique_ptr<llvm::MemoryBuffer> buffer) : buffer(std::move(buffer))
+	{
+	}
+
+	llvm::StringRef contents() const
+	{
+		return buffer->getBuffer();
+	}
+
+	bool validate()
+	{
+		auto data = contents();
+		if (data.size() < headerSize || std::memcmp(data.data(), magic, sizeof(magic)) != 0 ||
+			llvm::support::endian::read32le(data.data() + 8) != version)
+		{
+			return false;
+		}
+
+		count = llvm::support::endian::read32le(data.data() + 12);
+		if ((data.size() - headerSize) / entrySize < count)
+		{
+			return false;
+		}
+		for (size_t index = 0; index < count; index++)
+		{
+			const char *base = data.data() + headerSize + index * entrySize;
+			for (size_t field = 0; field < 4; field += 2)
+			{
+				auto offset = llvm::support::endian::read64le(base + field * 8);
+				auto length = llvm::support::endian::read64le(base + field * 8 + 8);
+				if (offset > data.size() || length > data.size() - offset)
+				{
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+};
+
+/**
+ * Collects modules from any number of threads and writes them as an
+ * archive with large sequential writes.
+ */
+class Writer
+{
+  public:
+	void add(std::string name, std::string data)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		modules.emplace_back(std::move(name), std::move(data));
+	}
+
+	size_t size() const
+	{
+		return modules.size();
+	}
+
+	/**
+	 * Write the archive to `stream`.
+	 */
+	void write(llvm::raw_ostream &stream)
+	{
+		std::sort(modules.begin(), modules.end());
+
+		auto namesOffset = headerSize + modules.size() * entrySize;
+		auto dataOffset = namesOffset;
+		for (const auto &[name, data] : modules)
+		{
+			dataOffset += name.size();
+		}
+		dataOffset = llvm::alignTo(dataOffset, alignment);
+
+		llvm::support::endian::Writer out(stream, llvm::support::little);
+		stream.write(magic, sizeof(magic));
+		out.write<uint32_t>(version);
+		out.write<uint32_t>(modules.size());
+
+		auto nameOffset = namesOffset;
+		auto offset = dataOffset;
+		for (const auto &[name, data] : modules)
+		{
+			out.write<uint64_t>(nameOffset);
+			out.write<uint64_t>(name.size());
+			out.write<uint64_t>(offset);
+			out.write<uint64_t>(data.size());
+			out.write<uint64_t>(hash(data));
+			nameOffset += name.size();
+			offset = llvm::alignTo(offset + data.size(), alignment);
+		}
+
+		for (const auto &[name, data] : modules)
+		{
+			stream << name;
+		}
+		stream.write_zeros(dataOffset - nameOffset);
+
+		offset = dataOffset;
+		for (const auto &[name, data] : modules)
+		{
+			stream << data;
+			auto next = llvm::alignTo(offset + data.size(), alignment);
+			stream.write_zeros(next - offset - data.size());
+			offset = next;
+		}
+	}
+
+  private:
+	std::vector<std::pair<std::string, std::string>> modules;
+	std::mutex lock;
+};
+
+} // namespace splitArchive
+
+#endif
@@ -1,381 +1,233 @@
 /*
- * A program that uses llvm-extract to split
- * LLVM bitcode `*.bc` files into modules containing only
- * a single function/global.
+ * A program that splits LLVM bitcode `*.bc` files into modules
+ * containing only a single function/global.
  *
- * The exact llvm-extract binary can be be passed as the env
- * var LLVM_EXTRACT to override the default. The reason to do so
- * is that it may differ depending on architectures/systems.
+ * This is the command line front end of the function splitter library
+ * (see function-split.h), which does the splitting.
  */
 
-#include "llvm/IR/GlobalObject.h"
+#include "function-split.h"
 #include <algorithm>
-#include <execution>
 #include <fstream>
 #include <iostream>
-#include <memory>
-#include <pstl/glue_execution_defs.h>
-#include <queue>
-#include <sstream>
 #include <string>
-#include <system_error>
-#include <unordered_map>
-#include <unordered_set>
+#include <thread>
+#include <vector>
 
-#include <llvm/ADT/SmallVector.h>
-#include <llvm/ADT/StringExtras.h>
 #include <llvm/ADT/StringRef.h>
-#include <llvm/Analysis/CallGraph.h>
-#include <llvm/Bitcode/BitcodeWriter.h>
-#include <llvm/IR/Argument.h>
-#include <llvm/IR/Constant.h>
-#include <llvm/IR/DebugInfo.h>
-#include <llvm/IR/DerivedTypes.h>
-#include <llvm/IR/DerivedUser.h>
-#include <llvm/IR/Function.h>
-#include <llvm/IR/GlobalValue.h>
-#include <llvm/IR/GlobalVariable.h>
-#include <llvm/IR/InstVisitor.h>
-#include <llvm/IR/InstrTypes.h>
-#include <llvm/IR/Instruction.h>
-#include <llvm/IR/Instructions.h>
-#include <llvm/IR/Module.h>
-#include <llvm/IR/Operator.h>
-#include <llvm/IR/Use.h>
-#include <llvm/IR/User.h>
-#include <llvm/IRReader/IRReader.h>
-#include <llvm/Pass.h>
-#include <llvm/Support/Casting.h>
 #include <llvm/Support/CommandLine.h>
-#include <llvm/Support/SourceMgr.h>
 #include <llvm/Support/raw_ostream.h>
-#include <llvm/Transforms/Utils/Cloning.h>
-#include <llvm/Transforms/Utils/ValueMapper.h>
 
-#include <assert.h>
-#include <filesystem>
-#include <stack>
-#include <thread>
-#include <typeinfo>
+using functionSplit::EmitKind;
 
-static llvm::LLVMContext context;
-llvm::SMDiagnostic err;
+llvm::cl::list<std::string> inputFilenames(llvm::cl::Positional,
+											llvm::cl::desc("<input files>"));
 
-llvm::cl::opt<std::string> inputFilename(llvm::cl::Positional, llvm::cl::desc("<input file>"),
-										 llvm::cl::Required);
+llvm::cl::opt<std::string> inputList(
+	"input-list",
+	llvm::cl::desc("A file listing more input files, one per line. Several inputs are split "
+				   "together, without linking them first."),
+	llvm::cl::value_desc("filename"));
 
 llvm::cl::opt<std::string>
 	outputDirectory("o", llvm::cl::desc("Where the output files will be created."),
 					llvm::cl::Required);
-llvm::cl::opt<bool> dry("d", llvm::cl::desc("Run without executing the commands."));
+llvm::cl::opt<bool> dry("d", llvm::cl::desc("Run without writing any of the split modules."));
 
 llvm::cl::opt<bool> verbose("v", llvm::cl::desc("Enable verbose output."));
 
-/**
- * Utilize the User api to find all of the operands
- * referenced by a specific instruction.
- *
- * It uses an in-order tree traversal to find all the
- * operands and then stores the ones of type llvm::GlobalVariable
- * and are constants in the globals set.
- *
- * @param user The instruction from which the iteration starts.
- * @return A set of the global variables referenced by user.
- */
-std::unordered_set<llvm::GlobalVariable *> iterateOperands(llvm::User &user)
-{
-	std::stack<llvm::Value *> operands;
-	std::unordered_set<llvm::GlobalVariable *> globals;
-
-	for (auto &operand : user.operands())
-	{
-		operands.push(operand);
-	}
-
-	while (operands.size() > 0)
-	{
-		auto currentOperand = operands.top();
-		operands.pop();
-
-		if (auto globalVariable = llvm::dyn_cast<llvm::GlobalVariable>(currentOperand))
-		{
-			if (globalVariable->isConstant())
-			{
-				globals.insert(globalVariable);
-			}
-		}
-		else if (auto user = llvm::dyn_cast<llvm::User>(currentOperand))
-		{
-
-			for (auto &nextOperand : user->operands())
-			{
-				if (auto instruction = llvm::dyn_cast<llvm::Instruction>(nextOperand))
-				{
-					continue;
-				}
-				else
-				{
-					operands.push(nextOperand);
-				}
-			}
-		}
-	}
-	return globals;
-}
-
-/**
- * This function uses iterateOperands to find all the
- * globals that will be moved. Then it uses iterateOperands
- * on their initializers (initializers are llvm::Constant which
- * are like instructions but can be resolved at compile time)
- * to see which other globals will need to be moved with them.
- *
- * This algorithm uses BFS to iterate the tree and find all of
- * the needed llvm::GlobalVariable.
- *
- * @user The user from which the search starts.
- * @return All of the global constants that must be moved together.
- */
-std::unordered_set<llvm::GlobalVariable *> resolveAllDependencies(llvm::User &user)
-{
-	std::unordered_set<llvm::GlobalVariable *> globals;
-	std::queue<llvm::GlobalVariable *> queueVariablesNeedMoving;
-	for (const auto item : iterateOperands(user))
-	{
-		queueVariablesNeedMoving.push(item);
-	}
-	while (queueVariablesNeedMoving.size() > 0)
-	{
-		auto currentVariable = queueVariablesNeedMoving.front();
-		queueVariablesNeedMoving.pop();
-		globals.insert(currentVariable);
-
-		if (currentVariable->hasInitializer())
-		{
-			for (const auto item : iterateOperands(*currentVariable->getInitializer()))
-			{
-				if (globals.find(item) == globals.end())
-				{
-					queueVariablesNeedMoving.push(item);
-				}
-			}
-		}
-	}
-	return globals;
-}
-
-/**
- * This is an LLVM instruction visitor.
- * Instead of manually going over all of the basic blocks
- * and then iterating over the instruction a visitor is used
- * to get to the instructions directly.
- */
-struct MyPass : public llvm::InstVisitor<MyPass>
-{
-	std::unordered_set<llvm::GlobalVariable *> globals;
-	void visitInstruction(llvm::Instruction &instruction)
-	{
-		for (const auto item : resolveAllDependencies(instruction))
-		{
-			globals.insert(item);
-		}
-	}
-};
-
-/**
- * @return The filename of the function/global/variable using the
- * debug information. Returns an empty string if no debug info
- * can be found.
- */
-std::string getFileName(llvm::GlobalObject &value)
-{
-	llvm::SmallVector<std::pair<unsigned, llvm::MDNode *>, 4> MDs;
-	value.getAllMetadata(MDs);
-	for (auto &MD : MDs)
-	{
-		if (llvm::MDNode *N = MD.second)
-		{
-			if (auto *subProgram = llvm::dyn_cast<llvm::DISubprogram>(N))
-			{
-				return subProgram->getFilename().str();
-			}
-		}
-	}
-	return "";
-}
+llvm::cl::opt<unsigned> jobs("j", llvm::cl::desc("Number of worker threads used for splitting."),
+							 llvm::cl::init(std::max(1u, std::thread::hardware_concurrency())));
+
+llvm::cl::opt<bool>
+	force("f", llvm::cl::desc("Extract every module, even if the manifest says it is unchanged."));
+
+llvm::cl::opt<unsigned> partitions(
+	"partitions",
+	llvm::cl::desc("Group the functions into at most this many modules, keeping the functions "
+				   "which call each other the most in the same module. With a profile, this "
+				   "only limits the modules of hot functions, cold ones stay on their own."),
+	llvm::cl::init(0));
+
+llvm::cl::opt<uint64_t> maxPartitionSize(
+	"max-partition-size",
+	llvm::cl::desc("Group the functions into modules of at most this many instructions, keeping "
+				   "the functions which call each other the most in the same module."),
+	llvm::cl::init(0));
+
+llvm::cl::opt<bool> useProfileMetadata(
+	"use-profile-metadata",
+	llvm::cl::desc("Group the functions which call each other the most according to the profile "
+				   "metadata in the input, and leave cold functions in modules on their own."));
+
+llvm::cl::opt<std::string> profileFile(
+	"profile",
+	llvm::cl::desc("Group the functions which call each other the most according to a count "
+				   "file, and leave cold functions in modules on their own."),
+	llvm::cl::value_desc("filename"));
+
+llvm::cl::opt<double> hotFraction(
+	"hot-fraction",
+	llvm::cl::desc("The fraction of the profiled calls made by the hot call edges."),
+	llvm::cl::init(0.99));
+
+llvm::cl::opt<EmitKind> emitKind(
+	"emit", llvm::cl::desc("What to generate for every split module, besides the bitcode."),
+	llvm::cl::values(clEnumValN(EmitKind::Bitcode, "bc", "Only the bitcode (default)."),
+					 clEnumValN(EmitKind::Object, "obj", "An object file, _<name>.o."),
+					 clEnumValN(EmitKind::SharedLibrary, "so",
+								"An object file and a shared library, lib_<name>.so. The "
+								"module with main only gets an object file.")),
+	llvm::cl::init(EmitKind::Bitcode));
+
+llvm::cl::opt<unsigned> codegenOptLevel("codegen-opt-level",
+										llvm::cl::desc("The optimization level (0-3) of the code "
+													   "generated with --emit."),
+										llvm::cl::init(2));
+
+llvm::cl::opt<std::string> linker("linker",
+								  llvm::cl::desc("The compiler driver used to link the shared "
+												 "libraries with --emit=so."),
+								  llvm::cl::init("clang"));
+
+llvm::cl::list<std::string> linkerFlags("linker-flag",
+										llvm::cl::desc("An extra flag passed to the linker, like "
+													   "--config for a CHERI target."));
+
+llvm::cl::opt<bool> archive(
+	"archive",
+	llvm::cl::desc("Write the bitcode of all of the split modules to a single indexed file, "
+				   "split.archive, instead of one _<name>.bc file per module."));
+
+llvm::cl::opt<bool> constantPool(
+	"constant-pool",
+	llvm::cl::desc("Move the constants used by more than one module into a single shared "
+				   "module, _constant.pool.bc, instead of copying them into every module."));
+
+llvm::cl::opt<bool> dataModules(
+	"data-modules",
+	llvm::cl::desc("Move the mutable global variables which the same functions access into "
+				   "shared modules, _data.<n>.bc, ordered by how often they are accessed, "
+				   "instead of one module per variable."));
+
+llvm::cl::opt<uint64_t> dataModuleSize(
+	"data-module-size",
+	llvm::cl::desc("With --data-modules, the size in bytes a data module grows to at most."),
+	llvm::cl::init(4096));
+
+llvm::cl::opt<unsigned> leafCloneSize(
+	"clone-leaves",
+	llvm::cl::desc("Copy the functions of at most this many instructions which call nothing "
+				   "and have no side effects into every module calling them, as internal "
+				   "functions the optimizer can inline, besides their own module."),
+	llvm::cl::init(0));
+
+llvm::cl::opt<bool> compact(
+	"compact",
+	llvm::cl::desc("Remove what the split modules do not need before writing them: irrelevant "
+				   "named metadata, debug info not reachable from their definitions and the "
+				   "names of local values."));
+
+llvm::cl::opt<bool> stripDebug("strip-debug",
+							   llvm::cl::desc("With --compact, remove all of the debug info."));
+
+llvm::cl::opt<bool> callTables(
+	"call-tables",
+	llvm::cl::desc("Call the functions of other split modules through a table of function "
+				   "pointers in every module, filled when it is loaded, instead of through "
+				   "the PLT."));
+
+llvm::cl::opt<bool> lazyStubs(
+	"lazy-stubs",
+	llvm::cl::desc("Load the libraries of the split functions on their first call: the other "
+				   "modules reach them through stubs in _lazy.stubs.bc, which dlopen the "
+				   "library and bind the function. The libraries which must be linked are "
+				   "listed in lazy-link.flags."));
+
+llvm::cl::opt<bool> exportLists(
+	"export-lists",
+	llvm::cl::desc("Write a version script, _<name>.exports, for every module, which exports "
+				   "only the symbols other modules use, and the list of symbols the "
+				   "executable must export, _main.dynamic-list."));
+
+llvm::cl::opt<bool> streaming(
+	"streaming",
+	llvm::cl::desc("Load the input lazily and materialize one function body at a time, "
+				   "freeing it once extracted, instead of loading the whole module in every "
+				   "worker. Cannot be combined with grouping or --constant-pool."));
+
+llvm::cl::opt<uint64_t> maxRss(
+	"max-rss",
+	llvm::cl::desc("With --streaming, the resident memory (in MiB) to stay under: fewer workers "
+				   "are started, and a job waits for the others to finish while the memory in "
+				   "use is over the limit."),
+	llvm::cl::init(0));
+
+llvm::cl::opt<bool> timeReport("time-report",
+							   llvm::cl::desc("Print how long every stage and job took."));
+
+llvm::cl::opt<std::string> traceFile(
+	"trace",
+	llvm::cl::desc("Write a Chrome trace (trace event JSON) of the stages and of the jobs run "
+				   "by every worker."),
+	llvm::cl::value_desc("filename"));
 
 int main(int argc, char **argv)
 {
 	llvm::cl::ParseCommandLineOptions(argc, argv);
 
-	std::string file;
-	std::error_code ecode;
-	std::unique_ptr<llvm::Module> loadedModule = llvm::parseIRFile(inputFilename, err, context);
-	std::unordered_map<const llvm::Function *, std::set<llvm::GlobalVariable *>> users;
-	std::string extractFilename = "temp.bc";
-	std::string extractProgram = "llvm-extract";
-
-	if (auto extractProgramOverride = std::getenv("LLVM_EXTRACT"))
-	{
-		extractProgram = std::string(extractProgramOverride);
-	}
-
-	/**
-	 * Moving happens on multiple stages.
-	 *
-	 * This is the first stage where all the properties of the
-	 * globals and functions in the modules are changed and saved
-	 * as a temporary module. This is done because later on
-	 * llvm-extract will be ran on this new module not on the
-	 * one given as an argument to the program.
-	 */
-
-	for (auto &global : loadedModule->globals())
+	std::vector<std::string> inputs(inputFilenames.begin(), inputFilenames.end());
+	if (!inputList.empty())
 	{
-		if (!global.hasHiddenVisibility())
+		std::ifstream list(inputList);
+		if (!list)
 		{
-			global.setDSOLocal(false);
-			global.setLinkage(llvm::GlobalValue::LinkageTypes::ExternalLinkage);
-			global.setVisibility(llvm::GlobalValue::VisibilityTypes::DefaultVisibility);
+			llvm::errs() << inputList << ": could not open the input list\n";
+			return 1;
 		}
-	}
-
-	for (auto &function : loadedModule->functions())
-	{
-		if (function.isDeclaration())
-		{
-			continue;
-		}
-		function.setDSOLocal(false);
-		function.setLinkage(llvm::GlobalValue::ExternalLinkage);
-		function.setVisibility(llvm::GlobalValue::VisibilityTypes::DefaultVisibility);
-	}
-
-	if (!dry)
-	{
-		llvm::raw_fd_ostream outputFile("temp.bc", ecode);
-		llvm::WriteBitcodeToFile(*loadedModule, outputFile);
-		outputFile.close();
-	}
-
-	/**
-	 * This is the second stage.
-	 *
-	 * Here we find all of the globals that are suitable for
-	 * moving, create a command to move them and then execute it,
-	 */
-#pragma omp parallel
-#pragma omp single
-	for (llvm::GlobalVariable &globalVariable : loadedModule->globals())
-	{
-		std::string globName;
-
-		if (globalVariable.isConstant() && globalVariable.hasInitializer())
+		std::string line;
+		while (std::getline(list, line))
 		{
-			if (!globalVariable.getInitializer()->hasName())
+			if (!llvm::StringRef(line).trim().empty())
 			{
-				continue;
+				inputs.push_back(llvm::StringRef(line).trim().str());
 			}
-			globName = globalVariable.getInitializer()->getName().str();
-		}
-		else
-		{
-			globName = globalVariable.getName().str();
-		}
-
-		std::cout << getFileName(globalVariable) << "\n";
-		std::stringstream command;
-		command << extractProgram << " " << extractFilename << " --glob=" << globName << " ";
-
-		if (globalVariable.hasInitializer())
-		{
-			for (const auto dependency : resolveAllDependencies(*globalVariable.getInitializer()))
-			{
-				command << " --glob=" << dependency->getName().str() << " ";
-			}
-		}
-
-		// Create directory if it does not exist
-		std::filesystem::create_directory(outputDirectory.c_str());
-		command << "-o " << outputDirectory << "/"
-				<< "_" << globName << ".bc ";
-
-		std::cout << command.str() << "\n\n";
-		std::string materializedCommand = command.str();
-#pragma omp task
-		if (!dry)
-		{
-			system(materializedCommand.c_str());
 		}
 	}
-
-	/**
-	 * This is the third stage.
-	 *
-	 * Here all of the already moved variables' definitions get changed to
-	 * declarations. This is done because when moving llvm-extract will just
-	 * copy the referenced globals, but that means that it will copy it as an
-	 * empty definition, which will fail when compiling, when changed to a
-	 * declaration it would expect the global to be defined in an external module.
-	 * Changing these things again requires creating a new temp.bc file that will
-	 * then be used when splitting.
-	 */
-	for (auto &global : loadedModule->globals())
+	if (inputs.empty())
 	{
-		if (global.isConstant())
-		{
-			continue;
-		}
-		global.setDSOLocal(false);
-		global.setInitializer(nullptr);
-	}
-
-	if (!dry)
-	{
-		llvm::raw_fd_ostream outputFile("temp.bc", ecode);
-		llvm::WriteBitcodeToFile(*loadedModule, outputFile);
-		outputFile.close();
+		llvm::errs() << argv[0] << ": no input files\n";
+		return 1;
 	}
 
-	/**
-	 * This is the fourth and final stage.
-	 *
-	 * All of the functions are iterated and commands for splitting
-	 * them are then created and executed.
-	 */
-#pragma omp parallel
-#pragma omp single
-	for (llvm::Function &function : loadedModule->functions())
-	{
-		if (function.isDeclaration())
-		{
-			continue;
-		}
-
-		std::cout << "filename: " << getFileName(function) << "\n";
-
-		const auto name = function.getName().str();
-		MyPass pass;
-		pass.visit(function);
-
-		std::stringstream command;
-		command << extractProgram << " " << extractFilename << " --func=" << name << " ";
-
-		for (auto const &use : pass.globals)
-		{
-			command << "--glob=" << use->getName().str() << " ";
-		}
-
-		command << "-o " << outputDirectory << "/"
-				<< "_" << name << ".bc ";
-
-		std::cout << command.str() << "\n\n";
-		const auto materializedCommand = command.str();
-#pragma omp task
-		if (!dry)
-		{
-			std::cout << "# " << std::this_thread::get_id() << " : " << name << "\n";
-			system(materializedCommand.c_str());
-		}
-	}
+	functionSplit::Options options;
+	options.outputDirectory = outputDirectory;
+	options.dry = dry;
+	options.jobs = jobs;
+	options.force = force;
+	options.partitions = partitions;
+	options.maxPartitionSize = maxPartitionSize;
+	options.useProfileMetadata = useProfileMetadata;
+	options.profileFile = profileFile;
+	options.hotFraction = hotFraction;
+	options.emit = emitKind;
+	options.codegenOptLevel = codegenOptLevel;
+	options.linker = linker;
+	options.linkerFlags.assign(linkerFlags.begin(), linkerFlags.end());
+	options.archive = archive;
+	options.constantPool = constantPool;
+	options.dataModules = dataModules;
+	options.dataModuleSize = dataModuleSize;
+	options.leafCloneSize = leafCloneSize;
+	options.compact = compact;
+	options.stripDebug = stripDebug;
+	options.callTables = callTables;
+	options.lazyStubs = lazyStubs;
+	options.exportLists = exportLists;
+	options.streaming = streaming;
+	options.maxRss = maxRss;
+	options.timeReport = timeReport;
+	options.traceFile = traceFile;
+	options.log = &std::cout;
+	return functionSplit::splitFiles(inputs, options) ? 0 : 1;
 }
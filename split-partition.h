@@ -0,0 +1,762 @@
+/*
+ * The partitioner: splits a module into any number of modules by
+ * cloning, given the partition each symbol belongs to.
+ *
+ * The source module is walked once, to find the owner and the direct
+ * references of every global value. Each partition is then the closure
+ * of the definitions it owns, built with its own value to value map:
+ *
+ *   - the definitions assigned to the partition are cloned,
+ *   - local constants (string literals, tables) it references are
+ *     cloned as well, so they stay local in every partition using them,
+ *   - everything else it references is only declared.
+ *
+ * A local function or variable referenced from another partition is made
+ * external in the partition defining it, as `publicizeSymbols` does in
+ * split-llvm-extract. A value assigned to `none` is not defined in any
+ * partition, but is still declared where it is referenced.
+ *
+ * The partitions are cloned into the context of the source module, one
+ * after the other, as that creates constants in the context. Writing
+ * them as bitcode uses the context too, so that is also done one at a
+ * time, and only the files are written from several threads.
+ *
+ * `extract` builds a single module the way `llvm-extract` does instead:
+ * the selected values are cloned and whatever they reach is declared,
+ * without looking at the rest of the source, so that extracting every
+ * symbol of a module one at a time stays linear in its size.
+ */
+
+#ifndef SPLIT_PARTITION_H
+#define SPLIT_PARTITION_H
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalAlias.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/Casting.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/IR/DebugInfoMetadata.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+
+namespace splitPartition
+{
+
+/**
+ * The partition of the values which are not defined in any partition.
+ */
+const unsigned none = ~0u;
+
+/**
+ * @return The partition defining a function or a global variable, or
+ * `none`. It is only called for definitions, never for declarations.
+ */
+using Assignment = std::function<unsigned(const llvm::GlobalValue &)>;
+
+/**
+ * @return An assignment looking up the name of the values in `table`,
+ * with the values it does not list going to `fallback`.
+ */
+inline Assignment fromTable(std::unordered_map<std::string, unsigned> table, unsigned fallback)
+{
+	return [table = std::move(table), fallback](const llvm::GlobalValue &value)
+	{
+		auto found = table.find(value.getName().str());
+		return found != table.end() ? found->second : fallback;
+	};
+}
+
+namespace detail
+{
+
+enum class Role
+{
+	Define,
+	Duplicate,
+	Declare
+};
+
+inline void copyComdat(const llvm::GlobalObject *source, llvm::GlobalObject *destination)
+{
+	if (const auto *comdat = source->getComdat())
+	{
+		auto *newComdat = destination->getParent()->getOrInsertComdat(comdat->getName());
+		newComdat->setSelectionKind(comdat->getSelectionKind());
+		destination->setComdat(newComdat);
+	}
+}
+
+/**
+ * Add the global values used by `constant` to `references`, looking
+ * through constant expressions and aggregates.
+ */
+inline void collectReferences(const llvm::Constant *constant,
+							  std::unordered_set<const llvm::Constant *> &visited,
+							  std::vector<const llvm::GlobalValue *> &references)
+{
+	if (!visited.insert(constant).second)
+	{
+		return;
+	}
+	if (auto global = llvm::dyn_cast<llvm::GlobalValue>(constant))
+	{
+		references.push_back(global);
+		return;
+	}
+	for (const auto &operand : constant->operands())
+	{
+		if (auto operandConstant = llvm::dyn_cast<llvm::Constant>(operand))
+		{
+			collectReferences(operandConstant, visited, references);
+		}
+	}
+}
+
+/**
+ * @return The global values the definition of `value` uses directly.
+ */
+inline std::vector<const llvm::GlobalValue *> directReferences(const llvm::GlobalValue &value)
+{
+	std::unordered_set<const llvm::Constant *> visited;
+	std::vector<const llvm::GlobalValue *> references;
+	if (auto function = llvm::dyn_cast<llvm::Function>(&value))
+	{
+		for (const auto &instruction : llvm::instructions(function))
+		{
+			for (const auto &operand : instruction.operands())
+			{
+				if (auto constant = llvm::dyn_cast<llvm::Constant>(operand))
+				{
+					collectReferences(constant, visited, references);
+				}
+			}
+		}
+		if (function->hasPersonalityFn())
+		{
+			collectReferences(function->getPersonalityFn(), visited, references);
+		}
+	}
+	else if (auto variable = llvm::dyn_cast<llvm::GlobalVariable>(&value))
+	{
+		if (variable->hasInitializer())
+		{
+			collectReferences(variable->getInitializer(), visited, references);
+		}
+	}
+	else if (auto alias = llvm::dyn_cast<llvm::GlobalAlias>(&value))
+	{
+		collectReferences(alias->getAliasee(), visited, references);
+	}
+	references.erase(std::remove(references.begin(), references.end(), &value), references.end());
+	return references;
+}
+
+/**
+ * @return A declaration of `value` in `module`.
+ */
+inline llvm::GlobalValue *declare(llvm::Module &module, const llvm::GlobalValue &value)
+{
+	llvm::GlobalValue *result;
+	if (auto functionType = llvm::dyn_cast<llvm::FunctionType>(value.getValueType()))
+	{
+		auto function = llvm::Function::Create(functionType, llvm::GlobalValue::ExternalLinkage,
+											   value.getAddressSpace(), value.getName(), &module);
+		if (auto source = llvm::dyn_cast<llvm::Function>(&value))
+		{
+			function->setCallingConv(source->getCallingConv());
+			function->setAttributes(source->getAttributes());
+		}
+		result = function;
+	}
+	else
+	{
+		auto variable = llvm::dyn_cast<llvm::GlobalVariable>(&value);
+		result = new llvm::GlobalVariable(
+			module, value.getValueType(), variable && variable->isConstant(),
+			llvm::GlobalValue::ExternalLinkage, nullptr, value.getName(), nullptr,
+			value.getThreadLocalMode(), value.getAddressSpace());
+	}
+	if (!value.hasLocalLinkage())
+	{
+		result->setVisibility(value.getVisibility());
+	}
+	return result;
+}
+
+/**
+ * Declares, in the module being extracted, the global values of the
+ * source which the cloned definitions reach but which are not extracted,
+ * when the value mapper first meets them.
+ */
+class Declarer : public llvm::ValueMaterializer
+{
+  public:
+	Declarer(const llvm::Module &source, llvm::Module &module) : source(source), module(module)
+	{
+	}
+
+	llvm::Value *materialize(llvm::Value *value) override
+	{
+		auto global = llvm::dyn_cast<llvm::GlobalValue>(value);
+		if (!global || global->getParent() != &source)
+		{
+			return nullptr;
+		}
+
+		// A definition which is not extracted becomes an external declaration,
+		// as with CloneModule, and it is hidden if it used to be local, as
+		// llvm-extract does.
+		const auto linkage =
+			global->isDeclaration() ? global->getLinkage() : llvm::GlobalValue::ExternalLinkage;
+		llvm::GlobalValue *result;
+		if (auto function = llvm::dyn_cast<llvm::Function>(global))
+		{
+			auto declaration =
+				llvm::Function::Create(function->getFunctionType(), linkage,
+									   function->getAddressSpace(), function->getName(), &module);
+			declaration->copyAttributesFrom(function);
+			declaration->setPersonalityFn(nullptr);
+			declaration->setPrefixData(nullptr);
+			declaration->setPrologueData(nullptr);
+			result = declaration;
+		}
+		else if (auto variable = llvm::dyn_cast<llvm::GlobalVariable>(global))
+		{
+			auto declaration = new llvm::GlobalVariable(
+				module, variable->getValueType(), variable->isConstant(), linkage, nullptr,
+				variable->getName(), nullptr, variable->getThreadLocalMode(),
+				variable->getAddressSpace());
+			declaration->copyAttributesFrom(variable);
+			result = declaration;
+		}
+		else if (auto functionType = llvm::dyn_cast<llvm::FunctionType>(global->getValueType()))
+		{
+			// An alias cannot be declared, so it is declared as what it aliases.
+			result = llvm::Function::Create(functionType, llvm::GlobalValue::ExternalLinkage,
+											global->getAddressSpace(), global->getName(), &module);
+		}
+		else
+		{
+			result = new llvm::GlobalVariable(
+				module, global->getValueType(), false, llvm::GlobalValue::ExternalLinkage, nullptr,
+				global->getName(), nullptr, global->getThreadLocalMode(),
+				global->getAddressSpace());
+		}
+		if (global->hasLocalLinkage())
+		{
+			result->setVisibility(llvm::GlobalValue::HiddenVisibility);
+		}
+		if (llvm::isa<llvm::GlobalVariable>(global) ||
+			(llvm::isa<llvm::Function>(global) && global->isDeclaration()))
+		{
+			pendingMetadata.emplace_back(llvm::cast<llvm::GlobalObject>(global),
+										 llvm::cast<llvm::GlobalObject>(result));
+		}
+		return result;
+	}
+
+	// The declarations whose metadata is still to be copied, which is done
+	// once the mapper is done with the definitions.
+	std::vector<std::pair<const llvm::GlobalObject *, llvm::GlobalObject *>> pendingMetadata;
+
+  private:
+	const llvm::Module &source;
+	llvm::Module &module;
+};
+
+inline void copyMetadata(const llvm::GlobalObject &source, llvm::GlobalObject &destination,
+						 llvm::ValueToValueMapTy &vMap, Declarer &declarer)
+{
+	llvm::SmallVector<std::pair<unsigned, llvm::MDNode *>, 1> metadataList;
+	source.getAllMetadata(metadataList);
+	for (auto [kind, node] : metadataList)
+	{
+		destination.addMetadata(kind,
+								*MapMetadata(node, vMap, llvm::RF_None, nullptr, &declarer));
+	}
+}
+
+} // namespace detail
+
+/**
+ * Extract `values` from `source` into a module of their own, as
+ * `llvm-extract --func=... --glob=...` does: the values keep their
+ * definitions, local ones becoming external and hidden and linkonce ones
+ * weak, and everything they reference is declared. Only the values and
+ * what they reach are visited, so the cost does not depend on the size
+ * of `source`.
+ *
+ * The compile units are limited to the ones the values reach, but the
+ * debug info they list is not trimmed (see StripDeadDebugInfo), nor are
+ * the declarations only used by metadata removed (see StripDeadPrototypes).
+ *
+ * @return The module, named after `source`, in its context.
+ */
+inline std::unique_ptr<llvm::Module> extract(const llvm::Module &source,
+											 const std::vector<llvm::GlobalValue *> &values)
+{
+	auto module = std::make_unique<llvm::Module>(source.getModuleIdentifier(), source.getContext());
+	module->setSourceFileName(source.getSourceFileName());
+	module->setDataLayout(source.getDataLayout());
+	module->setTargetTriple(source.getTargetTriple());
+
+	llvm::ValueToValueMapTy vMap;
+	detail::Declarer declarer(source, *module);
+
+	// Create all of the definitions first, so that the mapper finds them
+	// instead of declaring them.
+	for (const auto value : values)
+	{
+		llvm::GlobalValue *resultValue;
+		if (auto function = llvm::dyn_cast<llvm::Function>(value);
+			function && !function->isDeclaration())
+		{
+			resultValue = llvm::Function::Create(function->getFunctionType(),
+												 function->getLinkage(),
+												 function->getAddressSpace(),
+												 function->getName(), module.get());
+		}
+		else if (auto global = llvm::dyn_cast<llvm::GlobalVariable>(value);
+				 global && global->hasInitializer())
+		{
+			auto resultGlobal = new llvm::GlobalVariable(
+				*module, global->getValueType(), global->isConstant(), global->getLinkage(),
+				nullptr, global->getName(), nullptr, global->getThreadLocalMode(),
+				global->getAddressSpace());
+			resultGlobal->copyAttributesFrom(global);
+			resultValue = resultGlobal;
+		}
+		else if (auto alias = llvm::dyn_cast<llvm::GlobalAlias>(value))
+		{
+			auto resultAlias = llvm::GlobalAlias::create(
+				alias->getValueType(), alias->getAddressSpace(), alias->getLinkage(),
+				alias->getName(), nullptr, module.get());
+			resultAlias->copyAttributesFrom(alias);
+			resultValue = resultAlias;
+		}
+		else
+		{
+			resultValue = llvm::cast<llvm::GlobalValue>(declarer.materialize(value));
+		}
+		vMap[value] = resultValue;
+	}
+
+	for (const auto value : values)
+	{
+		auto resultValue = llvm::cast<llvm::GlobalValue>(vMap[value]);
+		if (value->isDeclaration() && !llvm::isa<llvm::GlobalAlias>(value))
+		{
+			continue;
+		}
+
+		if (auto function = llvm::dyn_cast<llvm::Function>(value))
+		{
+			auto resultFunction = llvm::cast<llvm::Function>(resultValue);
+			auto resultArg = resultFunction->arg_begin();
+			for (const auto &arg : function->args())
+			{
+				resultArg->setName(arg.getName());
+				vMap[&arg] = &*resultArg++;
+			}
+
+			llvm::SmallVector<llvm::ReturnInst *, 8> returns;
+			llvm::CloneFunctionInto(resultFunction, function, vMap,
+									llvm::CloneFunctionChangeType::ClonedModule, returns, "",
+									nullptr, nullptr, &declarer);
+			detail::copyComdat(function, resultFunction);
+		}
+		else if (auto global = llvm::dyn_cast<llvm::GlobalVariable>(value))
+		{
+			auto resultGlobal = llvm::cast<llvm::GlobalVariable>(resultValue);
+			detail::copyMetadata(*global, *resultGlobal, vMap, declarer);
+			resultGlobal->setInitializer(MapValue(global->getInitializer(), vMap, llvm::RF_None,
+												  nullptr, &declarer));
+			detail::copyComdat(global, resultGlobal);
+		}
+		else if (auto alias = llvm::dyn_cast<llvm::GlobalAlias>(value))
+		{
+			llvm::cast<llvm::GlobalAlias>(resultValue)
+				->setAliasee(
+					MapValue(alias->getAliasee(), vMap, llvm::RF_None, nullptr, &declarer));
+		}
+
+		if (resultValue->hasLocalLinkage())
+		{
+			resultValue->setLinkage(llvm::GlobalValue::ExternalLinkage);
+			resultValue->setVisibility(llvm::GlobalValue::HiddenVisibility);
+		}
+		else if (resultValue->getLinkage() == llvm::GlobalValue::LinkOnceAnyLinkage)
+		{
+			resultValue->setLinkage(llvm::GlobalValue::WeakAnyLinkage);
+		}
+		else if (resultValue->getLinkage() == llvm::GlobalValue::LinkOnceODRLinkage)
+		{
+			resultValue->setLinkage(llvm::GlobalValue::WeakODRLinkage);
+		}
+	}
+
+	// The named metadata, except for the compile units, which are the ones
+	// the definitions reached and are only known once everything is mapped.
+	for (const auto &namedMetadata : source.named_metadata())
+	{
+		auto resultMetadata = module->getOrInsertNamedMetadata(namedMetadata.getName());
+		if (namedMetadata.getName() == "llvm.dbg.cu")
+		{
+			continue;
+		}
+		for (auto node : namedMetadata.operands())
+		{
+			resultMetadata->addOperand(llvm::cast<llvm::MDNode>(
+				MapMetadata(node, vMap, llvm::RF_None, nullptr, &declarer)));
+		}
+	}
+
+	// Copying the metadata of a declaration may declare more values.
+	for (size_t next = 0; next < declarer.pendingMetadata.size(); next++)
+	{
+		auto [global, declaration] = declarer.pendingMetadata[next];
+		detail::copyMetadata(*global, *declaration, vMap, declarer);
+	}
+
+	if (auto compileUnits = source.getNamedMetadata("llvm.dbg.cu"))
+	{
+		auto resultUnits = module->getNamedMetadata("llvm.dbg.cu");
+		for (auto unit : compileUnits->operands())
+		{
+			if (auto mapped = vMap.getMappedMD(unit); mapped && *mapped)
+			{
+				resultUnits->addOperand(llvm::cast<llvm::MDNode>(*mapped));
+			}
+		}
+		if (resultUnits->getNumOperands() == 0)
+		{
+			resultUnits->eraseFromParent();
+		}
+	}
+	return module;
+}
+
+/**
+ * Split `source` into one module per name in `names`, with every
+ * definition going to the partition `assign` returns for it.
+ *
+ * @param source The module to split. It is not modified.
+ * @param names The names of the resulting modules.
+ * @param assign The partition of every definition of `source`.
+ * @return The partitions, in the context of `source`.
+ */
+inline std::vector<std::unique_ptr<llvm::Module>>
+partition(const llvm::Module &source, const std::vector<std::string> &names,
+		  const Assignment &assign)
+{
+	using detail::Role;
+
+	// The single traversal of the source: the owner and the direct
+	// references of every global value.
+	std::vector<const llvm::GlobalValue *> values;
+	for (const auto &global : source.global_values())
+	{
+		values.push_back(&global);
+	}
+	std::unordered_map<const llvm::GlobalValue *, size_t> indices;
+	for (size_t index = 0; index < values.size(); index++)
+	{
+		indices.emplace(values[index], index);
+	}
+
+	std::vector<unsigned> owners(values.size(), none);
+	std::vector<std::vector<size_t>> references(values.size());
+	for (size_t index = 0; index < values.size(); index++)
+	{
+		auto value = values[index];
+		if (value->isDeclaration())
+		{
+			continue;
+		}
+		if (llvm::isa<llvm::GlobalObject>(value))
+		{
+			owners[index] = assign(*value);
+			if (owners[index] != none && owners[index] >= names.size())
+			{
+				owners[index] = none;
+			}
+		}
+		for (auto reference : detail::directReferences(*value))
+		{
+			references[index].push_back(indices.at(reference));
+		}
+	}
+	// An alias lives with the object it aliases.
+	for (size_t index = 0; index < values.size(); index++)
+	{
+		if (auto alias = llvm::dyn_cast<llvm::GlobalAlias>(values[index]))
+		{
+			if (auto object = alias->getAliaseeObject())
+			{
+				owners[index] = owners[indices.at(object)];
+			}
+		}
+	}
+
+	auto duplicated = [&](size_t index)
+	{
+		auto variable = llvm::dyn_cast<llvm::GlobalVariable>(values[index]);
+		return variable && variable->hasLocalLinkage() && variable->isConstant() &&
+			   variable->hasInitializer();
+	};
+
+	// The closure of every partition. A local value which ends up declared
+	// somewhere is made external where it is defined.
+	std::vector<std::vector<std::pair<size_t, Role>>> contents(names.size());
+	std::vector<bool> promoted(values.size());
+	for (size_t index = 0; index < values.size(); index++)
+	{
+		if (owners[index] != none)
+		{
+			contents[owners[index]].emplace_back(index, Role::Define);
+		}
+	}
+	for (unsigned part = 0; part < names.size(); part++)
+	{
+		auto &content = contents[part];
+		std::unordered_set<size_t> included;
+		for (const auto &[index, role] : content)
+		{
+			included.insert(index);
+		}
+		for (size_t next = 0; next < content.size(); next++)
+		{
+			auto [index, role] = content[next];
+			if (role == Role::Declare)
+			{
+				continue;
+			}
+			for (auto reference : references[index])
+			{
+				if (!included.insert(reference).second)
+				{
+					continue;
+				}
+				if (duplicated(reference))
+				{
+					content.emplace_back(reference, Role::Duplicate);
+					continue;
+				}
+				content.emplace_back(reference, Role::Declare);
+				if (values[reference]->hasLocalLinkage())
+				{
+					promoted[reference] = true;
+				}
+			}
+		}
+		std::sort(content.begin(), content.end());
+	}
+
+	std::vector<std::unique_ptr<llvm::Module>> result;
+	for (unsigned part = 0; part < names.size(); part++)
+	{
+		auto module = std::make_unique<llvm::Module>(names[part], source.getContext());
+		module->setSourceFileName(source.getSourceFileName());
+		module->setDataLayout(source.getDataLayout());
+		module->setTargetTriple(source.getTargetTriple());
+		if (part == 0)
+		{
+			// Inline assembly may define symbols, so only one partition has it.
+			module->setModuleInlineAsm(source.getModuleInlineAsm());
+		}
+
+		/*
+		  The value to value map is the central datastructure to the function
+		  cloning/moving. It is used to map the llvm values that reside in the
+		  original module to the ones that reside in the new resulting module.
+		*/
+		llvm::ValueToValueMapTy vMap;
+
+		// Create all of the values first, so that the initializers and the
+		// function bodies can refer to any of them.
+		for (const auto &[index, role] : contents[part])
+		{
+			auto value = values[index];
+			llvm::GlobalValue *resultValue = nullptr;
+			if (role == Role::Declare)
+			{
+				resultValue = detail::declare(*module, *value);
+			}
+			else if (auto function = llvm::dyn_cast<llvm::Function>(value))
+			{
+				resultValue = llvm::Function::Create(function->getFunctionType(),
+													 function->getLinkage(),
+													 function->getAddressSpace(),
+													 function->getName(), module.get());
+			}
+			else if (auto global = llvm::dyn_cast<llvm::GlobalVariable>(value))
+			{
+				auto resultGlobal = new llvm::GlobalVariable(
+					*module, global->getValueType(), global->isConstant(), global->getLinkage(),
+					nullptr, global->getName(), nullptr, global->getThreadLocalMode(),
+					global->getType()->getAddressSpace());
+				resultGlobal->copyAttributesFrom(global);
+				resultValue = resultGlobal;
+			}
+			else if (auto alias = llvm::dyn_cast<llvm::GlobalAlias>(value))
+			{
+				resultValue = llvm::GlobalAlias::create(
+					alias->getValueType(), alias->getAddressSpace(), alias->getLinkage(),
+					alias->getName(), nullptr, module.get());
+				resultValue->setVisibility(alias->getVisibility());
+				resultValue->setUnnamedAddr(alias->getUnnamedAddr());
+				resultValue->setThreadLocalMode(alias->getThreadLocalMode());
+				resultValue->setDSOLocal(alias->isDSOLocal());
+			}
+			else
+			{
+				// Interfaces (ifuncs) are only ever declared.
+				resultValue = detail::declare(*module, *value);
+			}
+			vMap[value] = resultValue;
+		}
+
+		for (const auto &[index, role] : contents[part])
+		{
+			if (role == Role::Declare)
+			{
+				continue;
+			}
+			auto value = values[index];
+			auto resultValue = llvm::cast<llvm::GlobalValue>(vMap[value]);
+
+			if (auto function = llvm::dyn_cast<llvm::Function>(value))
+			{
+				auto resultFunction = llvm::cast<llvm::Function>(resultValue);
+				auto resultArg = resultFunction->arg_begin();
+				for (const auto &arg : function->args())
+				{
+					resultArg->setName(arg.getName());
+					vMap[&arg] = &*resultArg++;
+				}
+
+				llvm::SmallVector<llvm::ReturnInst *, 8> returns;
+				llvm::CloneFunctionInto(resultFunction, function, vMap,
+										llvm::CloneFunctionChangeType::DifferentModule, returns);
+				detail::copyComdat(function, resultFunction);
+			}
+			else if (auto global = llvm::dyn_cast<llvm::GlobalVariable>(value))
+			{
+				auto resultGlobal = llvm::cast<llvm::GlobalVariable>(resultValue);
+				llvm::SmallVector<std::pair<unsigned, llvm::MDNode *>, 1> metadataList;
+				global->getAllMetadata(metadataList);
+				for (auto [kind, node] : metadataList)
+				{
+					resultGlobal->addMetadata(kind, *MapMetadata(node, vMap));
+				}
+				resultGlobal->setInitializer(MapValue(global->getInitializer(), vMap));
+				detail::copyComdat(global, resultGlobal);
+			}
+			else if (auto alias = llvm::dyn_cast<llvm::GlobalAlias>(value))
+			{
+				llvm::cast<llvm::GlobalAlias>(resultValue)
+					->setAliasee(MapValue(alias->getAliasee(), vMap));
+			}
+
+			if (role == Role::Define && promoted[index])
+			{
+				resultValue->setLinkage(llvm::GlobalValue::ExternalLinkage);
+				resultValue->setVisibility(llvm::GlobalValue::DefaultVisibility);
+				resultValue->setDSOLocal(false);
+			}
+		}
+
+		// Cloning the bodies adds the list of compile units, even when
+		// there is no debug information to list.
+		auto compileUnits = module->getNamedMetadata("llvm.dbg.cu");
+		if (compileUnits && compileUnits->getNumOperands() == 0)
+		{
+			module->eraseNamedMetadata(compileUnits);
+		}
+
+		if (auto flags = source.getModuleFlagsMetadata())
+		{
+			auto resultFlags = module->getOrInsertModuleFlagsMetadata();
+			for (auto flag : flags->operands())
+			{
+				resultFlags->addOperand(llvm::cast<llvm::MDNode>(MapMetadata(flag, vMap)));
+			}
+		}
+
+		result.push_back(std::move(module));
+	}
+	return result;
+}
+
+/**
+ * Write every module of `modules` as bitcode to the path at the same
+ * index of `paths`, using up to `jobs` threads.
+ *
+ * The modules share a context, which LLVM does not allow using from
+ * several threads at once, so the bitcode of one module is produced at a
+ * time, while the other threads write theirs to disk.
+ *
+ * @return Whether every module was written. If not, `error` tells why.
+ */
+inline bool write(const std::vector<std::unique_ptr<llvm::Module>> &modules,
+				  const std::vector<std::string> &paths, unsigned jobs, std::string &error)
+{
+	std::atomic<size_t> next{0};
+	std::mutex contextLock;
+	std::mutex errorLock;
+	std::vector<std::thread> threads;
+	for (unsigned thread = 0; thread < std::min<size_t>(std::max(1u, jobs), modules.size());
+		 thread++)
+	{
+		threads.emplace_back(
+			[&]
+			{
+				for (auto index = next++; index < modules.size(); index = next++)
+				{
+					llvm::SmallVector<char, 0> bitcode;
+					{
+						std::lock_guard<std::mutex> guard(contextLock);
+						llvm::raw_svector_ostream stream(bitcode);
+						llvm::WriteBitcodeToFile(*modules[index], stream);
+					}
+
+					std::error_code ecode;
+					llvm::raw_fd_ostream output(paths[index], ecode);
+					if (ecode)
+					{
+						std::lock_guard<std::mutex> guard(errorLock);
+						error = paths[index] + ": " + ecode.message();
+						continue;
+					}
+					output.write(bitcode.data(), bitcode.size());
+				}
+			});
+	}
+	for (auto &thread : threads)
+	{
+		thread.join();
+	}
+	return error.empty();
+}
+
+} // namespace splitPartition
+
+#endif
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2021 The CapableVMs "CHERI Examples && LLVM FUNCTION SPLIT" Contributors.
+# SPDX-License-Identifier: MIT OR Apache-2.0
+#
+# Benchmark the split `lua.shared` against the monolithic `lua` on the
+# workloads in this directory.
+#
+# Every workload is run with the command of the `test` target of its
+# Makefile, a few times after some warmup runs, once with each interpreter.
+# The wall, user and system time, page faults and peak RSS of every run are
+# recorded, and the slowdown of the split interpreter (the ratio of the median
+# wall times) is reported for each workload as JSON.
+#
+# Other builds of the split interpreter (split with --call-tables, for
+# example) are measured too when given with --variant, and their speedup
+# over the default split interpreter is reported.
+#
+# When a baseline (a previous JSON report) is given, this fails if the
+# slowdown of any workload grew by more than the threshold.
+
+import argparse
+import json
+import os
+import statistics
+import subprocess
+import sys
+import time
+from pathlib import Path
+
+
+def workload_command(folder: Path, lua: str) -> str:
+    """The shell command the Makefile of `folder` runs for the `test` target."""
+    return subprocess.check_output(["make", "-s", "-n", "test", f"LUA={lua}"],
+                                   cwd=folder, text=True).strip()
+
+
+def run_once(folder: Path, command: str, env: dict) -> dict:
+    start = time.perf_counter()
+    process = subprocess.Popen(["/bin/sh", "-c", command], cwd=folder, env=env)
+    _, status, usage = os.wait4(process.pid, 0)
+    wall = time.perf_counter() - start
+    process.returncode = os.waitstatus_to_exitcode(status)
+    if process.returncode != 0:
+        raise RuntimeError(f"{folder.name}: '{command}' exited with {process.returncode}")
+
+    # ru_maxrss is in bytes on macOS and in kilobytes everywhere else.
+    rss = usage.ru_maxrss // 1024 if sys.platform == "darwin" else usage.ru_maxrss
+    return {
+        "wall": wall,
+        "user": usage.ru_utime,
+        "sys": usage.ru_stime,
+        "minor_faults": usage.ru_minflt,
+        "major_faults": usage.ru_majflt,
+        "max_rss_kb": rss,
+    }
+
+
+def measure(folder: Path, lua: Path, runs: int, warmup: int) -> dict:
+    env = dict(os.environ)
+    # The split interpreter finds its libraries next to it.
+    env["LD_LIBRARY_PATH"] = ":".join(filter(None, [str(lua.parent), env.get("LD_LIBRARY_PATH")]))
+    command = workload_command(folder, str(lua))
+
+    for _ in range(warmup):
+        run_once(folder, command, env)
+    samples = [run_once(folder, command, env) for _ in range(runs)]
+
+    # The output must still be right, or the timing means nothing.
+    expected = (folder / "out").read_bytes()
+    actual = (folder / "out.diff").read_bytes()
+    (folder / "out.diff").unlink()
+    if expected != actual:
+        raise RuntimeError(f"{folder.name}: {lua.name} produced the wrong output")
+
+    summary = {key: statistics.median(sample[key] for sample in samples)
+               for key in ("wall", "user", "sys", "minor_faults", "major_faults")}
+    summary["max_rss_kb"] = max(sample["max_rss_kb"] for sample in samples)
+    summary["samples"] = samples
+    return summary
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(
+        description="Benchmark the split lua.shared against the monolithic lua.")
+    parser.add_argument("--monolithic", type=Path, required=True,
+                        help="The monolithic lua interpreter.")
+    parser.add_argument("--split", type=Path, required=True,
+                        help="The split lua interpreter (lua.shared).")
+    parser.add_argument("--variant", action="append", default=[], metavar="NAME=PATH",
+                        help="Another split interpreter to compare with --split.")
+    parser.add_argument("--runs", type=int, default=5, help="Measured runs per workload.")
+    parser.add_argument("--warmup", type=int, default=1, help="Unmeasured runs per workload.")
+    parser.add_argument("--output", type=Path, default=Path("bench.json"),
+                        help="Where the JSON report is written.")
+    parser.add_argument("--baseline", type=Path,
+                        help="A previous JSON report to check for regressions against.")
+    parser.add_argument("--threshold", type=float, default=0.05,
+                        help="How much the slowdown of a workload may grow over the baseline, "
+                             "as a fraction (default 0.05).")
+    parser.add_argument("workloads", nargs="*",
+                        help="The workloads to run (default: all of the folders with an `out`).")
+    args = parser.parse_args()
+
+    variants = {}
+    for variant in args.variant:
+        name, separator, path = variant.partition("=")
+        if not separator:
+            parser.error(f"--variant {variant}: expected NAME=PATH")
+        variants[name] = Path(path)
+
+    here = Path(__file__).parent.resolve()
+    folders = [here / name for name in args.workloads] or \
+        sorted(folder for folder in here.iterdir() if (folder / "out").is_file())
+
+    report = {"runs": args.runs, "warmup": args.warmup, "benchmarks": {}}
+    for folder in folders:
+        monolithic = measure(folder, args.monolithic.resolve(), args.runs, args.warmup)
+        split = measure(folder, args.split.resolve(), args.runs, args.warmup)
+        slowdown = split["wall"] / monolithic["wall"]
+        report["benchmarks"][folder.name] = {
+            "monolithic": monolithic,
+            "split": split,
+            "slowdown": slowdown,
+        }
+        print(f"{folder.name}: {monolithic['wall']:.3f}s monolithic, {split['wall']:.3f}s split, "
+              f"slowdown {slowdown:.3f}")
+        for name, path in variants.items():
+            result = measure(folder, path.resolve(), args.runs, args.warmup)
+            result["slowdown"] = result["wall"] / monolithic["wall"]
+            result["speedup"] = split["wall"] / result["wall"]
+            report["benchmarks"][folder.name].setdefault("variants", {})[name] = result
+            print(f"  {name}: {result['wall']:.3f}s, slowdown {result['slowdown']:.3f}, "
+                  f"{result['speedup']:.3f}x the split interpreter")
+
+    args.output.write_text(json.dumps(report, indent=2) + "\n")
+
+    if args.baseline is None:
+        return 0
+    if not args.baseline.is_file():
+        print(f"{args.baseline}: no baseline, not checking for regressions")
+        return 0
+
+    baseline = json.loads(args.baseline.read_text())["benchmarks"]
+    regressions = 0
+    for name, result in report["benchmarks"].items():
+        if name not in baseline:
+            continue
+        limit = baseline[name]["slowdown"] * (1 + args.threshold)
+        if result["slowdown"] > limit:
+            print(f"regression {name}: slowdown {result['slowdown']:.3f}, "
+                  f"baseline {baseline[name]['slowdown']:.3f}")
+            regressions += 1
+    return 1 if regressions > 0 else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
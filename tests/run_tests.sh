@@ -53,7 +53,6 @@ CONFIG_FLAGS="--config cheribsd-${ARCH}-purecap.cfg"
 LD_LIBRARY_PATH=$CHERI/lib
 CC=$CHERI/bin/clang
 CXX=$CHERI/bin/clang++
-LLVM_EXTRACT=$CHERI/bin/llvm-extract
 AR=$CHERI/bin/llvm-ar
 RANLIB=$CHERI/bin/llvm-ranlib
 LLVM_LINK=$CHERI/bin/llvm-link
@@ -68,8 +67,7 @@ build_test_deps() {
 	install_gllvm
 	build_lua
 	# Split `lua`
-	LD_LIBRARY_PATH=$LD_LIBRARY_PATH LLVM_EXTRACT=$LLVM_EXTRACT ./split-llvm-extract lua.bc -o tests/lua
-	rm temp.bc
+	LD_LIBRARY_PATH=$LD_LIBRARY_PATH ./split-llvm-extract lua.bc -o tests/lua
 	rm lua.bc
 }
 
@@ -92,7 +90,7 @@ run_cargo_test() {
 			-y
 		source $HOME/.cargo/env
 	fi
-	CC=$CC LD_LIBRARY_PATH=$LD_LIBRARY_PATH LLVM_EXTRACT=$LLVM_EXTRACT cargo test
+	CC=$CC LD_LIBRARY_PATH=$LD_LIBRARY_PATH cargo test
 	popd
 }
 
@@ -118,7 +116,6 @@ run_tests() {
 		LLVM_CONFIG=$LLVM_CONFIG \
 		LLVM_LINK=$LLVM_LINK \
 		LD_LIBRARY_PATH=$LD_LIBRARY_PATH \
-		LLVM_EXTRACT=$LLVM_EXTRACT \
 	# Test the handling of `extern` variables with internal/hidden attribute
 	make test-extern-internal \
 		CC=$CC \
@@ -127,7 +124,6 @@ run_tests() {
 		LLVM_CONFIG=$LLVM_CONFIG \
 		LLVM_LINK=$LLVM_LINK \
 		LD_LIBRARY_PATH=$LD_LIBRARY_PATH \
-		LLVM_EXTRACT=$LLVM_EXTRACT \
 		LLVM_DIS=$LLVM_DIS \
 	# Test visibility is correctly set on global variables and functions
 	make test-visibility \
@@ -137,7 +133,6 @@ run_tests() {
 		LLVM_CONFIG=$LLVM_CONFIG \
 		LLVM_LINK=$LLVM_LINK \
 		LD_LIBRARY_PATH=$LD_LIBRARY_PATH \
-		LLVM_EXTRACT=$LLVM_EXTRACT \
 
 	run_cargo_test
 	build_lua_tests
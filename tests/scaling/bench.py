@@ -0,0 +1,205 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2021 The CapableVMs "CHERI Examples && LLVM FUNCTION SPLIT" Contributors.
+# SPDX-License-Identifier: MIT OR Apache-2.0
+#
+# Measure how the splitters scale with the size of their input.
+#
+# For every size, a module with that many functions is generated with
+# `generate-bitcode`, and every splitter is run on it in a directory of its
+# own. The wall, user and system time, peak RSS, and the number of files and
+# bytes written of every stage (generating the input and running each
+# splitter) are reported as JSON. split-llvm-extract is also run with
+# `--trace`, and the time of each of its own stages (and of each step of
+# its jobs, summed over the workers) is added to its entry, so that the
+# stage which grows too fast can be told apart from the others.
+#
+# Between two sizes, the growth of the time of a splitter, and of every
+# stage of split-llvm-extract, is reported as the exponent k of
+# time ~ size^k, so that anything above 1 stands out before it becomes a
+# problem on a large input.
+
+import argparse
+import json
+import math
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+from pathlib import Path
+
+ROOT = Path(__file__).resolve().parent.parent.parent
+TOOLS = ["split-llvm-extract", "manual-split", "find-and-split-static"]
+TRACE = "trace.json"
+
+
+def run(command: list, cwd: Path, timeout: float) -> dict:
+    """Run `command` in `cwd`, with the standard output going to `cwd/stdout`."""
+    with open(cwd / "stdout", "wb") as stdout:
+        start = time.perf_counter()
+        process = subprocess.Popen(command, cwd=cwd, stdout=stdout, stderr=subprocess.DEVNULL)
+        deadline = start + timeout
+        timed_out = False
+        while True:
+            pid, status, usage = os.wait4(process.pid, os.WNOHANG)
+            if pid != 0:
+                break
+            if time.perf_counter() > deadline:
+                process.kill()
+                timed_out = True
+                _, status, usage = os.wait4(process.pid, 0)
+                break
+            time.sleep(0.01)
+        wall = time.perf_counter() - start
+    process.returncode = os.waitstatus_to_exitcode(status)
+
+    files = [path for path in cwd.rglob("*")
+             if path.is_file() and path.name not in ("stdout", TRACE)]
+    # ru_maxrss is in bytes on macOS and in kilobytes everywhere else.
+    rss = usage.ru_maxrss // 1024 if sys.platform == "darwin" else usage.ru_maxrss
+    return {
+        "status": "timeout" if timed_out else process.returncode,
+        "wall": wall,
+        "user": usage.ru_utime,
+        "sys": usage.ru_stime,
+        "max_rss_kb": rss,
+        "files": len(files),
+        "bytes": sum(path.stat().st_size for path in files),
+        "stdout_bytes": (cwd / "stdout").stat().st_size,
+    }
+
+
+def tool_command(tool: str, tool_dir: Path, input_file: Path, work: Path, size: int,
+                 extra: list) -> list:
+    if tool == "split-llvm-extract":
+        return [str(tool_dir / tool), str(input_file), "-o", "out", "--trace", TRACE] + extra
+    if tool == "manual-split":
+        # One module per function, like split-llvm-extract.
+        return [str(tool_dir / tool), str(input_file), f"--partitions={size}", "-o",
+                "out"] + extra
+    if tool == "find-and-split-static":
+        # It takes a file listing the bitcode files.
+        (work / "files.txt").write_text(f"{input_file}\n")
+        return [str(tool_dir / tool), "files.txt"] + extra
+    return [str(tool_dir / tool), str(input_file)] + extra
+
+
+def trace_times(path: Path) -> dict:
+    """The seconds spent in every stage and step of a split-llvm-extract trace."""
+    times = {"stage_seconds": {}, "step_seconds": {}}
+    if not path.exists():
+        return times
+    for event in json.loads(path.read_text())["traceEvents"]:
+        if event.get("ph") == "X" and event.get("cat") in ("stage", "step"):
+            totals = times[event["cat"] + "_seconds"]
+            totals[event["name"]] = totals.get(event["name"], 0) + event["dur"] / 1e6
+    return times
+
+
+def growth(smaller: tuple, larger: tuple) -> float:
+    """The exponent k of time ~ size^k between two (size, time) points."""
+    (size1, time1), (size2, time2) = smaller, larger
+    if time1 <= 0 or time2 <= 0:
+        return float("nan")
+    return math.log(time2 / time1) / math.log(size2 / size1)
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="Measure how the splitters scale.")
+    parser.add_argument("--sizes", type=int, nargs="+", default=[1000, 10000, 100000],
+                        help="The numbers of functions to generate (default: 1k, 10k and "
+                             "100k; add 1000000 for the largest inputs).")
+    parser.add_argument("--tools", nargs="+", default=TOOLS, choices=TOOLS,
+                        help="The splitters to run (default: all of them).")
+    parser.add_argument("--tool-dir", type=Path, default=ROOT,
+                        help="Where the splitters are built (default: the repository root).")
+    parser.add_argument("--generator", type=Path,
+                        default=Path(__file__).parent / "generate-bitcode", help="The generate-bitcode program.")
+    parser.add_argument("--globals", type=float, default=1.0,
+                        help="Number of globals per function.")
+    parser.add_argument("--depth", type=int, default=4,
+                        help="How deep the constant tables are nested.")
+    parser.add_argument("--calls", type=int, default=4, help="Number of calls per function.")
+    parser.add_argument("--split-args", default="",
+                        help="Extra arguments for split-llvm-extract, like '-j 8'.")
+    parser.add_argument("--timeout", type=float, default=3600,
+                        help="Seconds after which a splitter is stopped (default: an hour).")
+    parser.add_argument("--keep", action="store_true",
+                        help="Keep the generated inputs and outputs in the work directory.")
+    parser.add_argument("--work-dir", type=Path,
+                        help="Where the inputs and outputs go (default: a temporary directory).")
+    parser.add_argument("--output", type=Path, default=Path("scaling.json"),
+                        help="Where the JSON report is written.")
+    args = parser.parse_args()
+
+    work_root = args.work_dir or Path(tempfile.mkdtemp(prefix="split-scaling-"))
+    work_root.mkdir(parents=True, exist_ok=True)
+    extra = {"split-llvm-extract": args.split_args.split()}
+
+    report = {
+        "globals_per_function": args.globals,
+        "depth": args.depth,
+        "calls": args.calls,
+        "sizes": {},
+        "growth": {},
+        "stage_growth": {},
+    }
+    for size in sorted(args.sizes):
+        work = work_root / str(size)
+        shutil.rmtree(work, ignore_errors=True)
+        (work / "generate").mkdir(parents=True)
+        input_file = work / "generate" / "input.bc"
+        stages = {"generate": run([str(args.generator.resolve()), "-o", str(input_file),
+                                   f"--functions={size}",
+                                   f"--globals={max(1, int(size * args.globals))}",
+                                   f"--depth={args.depth}", f"--calls={args.calls}"],
+                                  work / "generate", args.timeout)}
+        if stages["generate"]["status"] != 0:
+            print(f"{size}: generating the input failed", file=sys.stderr)
+            return 1
+        print(f"{size} functions: {stages['generate']['bytes']} bytes of bitcode in "
+              f"{stages['generate']['wall']:.2f}s")
+
+        for tool in args.tools:
+            (work / tool).mkdir()
+            command = tool_command(tool, args.tool_dir.resolve(), input_file, work / tool, size,
+                                   extra.get(tool, []))
+            stages[tool] = result = run(command, work / tool, args.timeout)
+            if tool == "split-llvm-extract":
+                result.update(trace_times(work / tool / TRACE))
+            print(f"  {tool}: {result['wall']:.2f}s, {result['max_rss_kb']} KiB peak RSS, "
+                  f"{result['files']} files, {result['bytes']} bytes (status {result['status']})")
+            if not args.keep:
+                shutil.rmtree(work / tool)
+
+        report["sizes"][str(size)] = stages
+        if not args.keep:
+            shutil.rmtree(work)
+
+    sizes = sorted(args.sizes)
+    for tool in args.tools:
+        points = [(size, report["sizes"][str(size)][tool]["wall"]) for size in sizes
+                  if report["sizes"][str(size)][tool]["status"] == 0]
+        exponents = [growth(a, b) for a, b in zip(points, points[1:])]
+        report["growth"][tool] = exponents
+        if exponents:
+            print(f"{tool}: time ~ size^{max(exponents):.2f} at worst")
+
+        finished = [(size, report["sizes"][str(size)][tool]) for size in sizes
+                    if report["sizes"][str(size)][tool]["status"] == 0]
+        names = {name for _, result in finished for name in result.get("stage_seconds", {})}
+        for name in sorted(names):
+            points = [(size, result["stage_seconds"].get(name, 0)) for size, result in finished]
+            report["stage_growth"].setdefault(tool, {})[name] = [
+                growth(a, b) for a, b in zip(points, points[1:])]
+
+    if not args.keep and args.work_dir is None:
+        shutil.rmtree(work_root)
+    args.output.write_text(json.dumps(report, indent=2) + "\n")
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
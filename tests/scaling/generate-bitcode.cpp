@@ -0,0 +1,165 @@
+/*
+ * A program that generates synthetic LLVM bitcode of a given size, for
+ * measuring how the splitters scale with the size of their input.
+ *
+ * The module has `--functions` functions `f<n>` and a `main`, each calling
+ * `--calls` functions picked at random, and `--globals` globals `g<n>`. Every
+ * function also reads a table `t<n>`, a constant struct nested `--depth`
+ * levels deep whose fields point to globals and functions. A quarter of the
+ * functions and globals are internal, as `static` ones in C would be.
+ *
+ * The same options and seed always generate the same module.
+ */
+
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/raw_ostream.h>
+
+static llvm::LLVMContext context;
+
+llvm::cl::opt<std::string> outputFilename("o", llvm::cl::desc("The bitcode file to write."),
+										  llvm::cl::value_desc("filename"), llvm::cl::Required);
+
+llvm::cl::opt<unsigned> functionCount("functions", llvm::cl::desc("Number of functions."),
+									  llvm::cl::init(1000));
+
+llvm::cl::opt<unsigned> globalCount("globals", llvm::cl::desc("Number of globals."),
+									llvm::cl::init(1000));
+
+llvm::cl::opt<unsigned> tableCount("tables",
+								   llvm::cl::desc("Number of nested constant tables (default: "
+												  "one for every 16 functions)."),
+								   llvm::cl::init(0));
+
+llvm::cl::opt<unsigned> depth("depth", llvm::cl::desc("How deep every constant table is nested."),
+							  llvm::cl::init(4));
+
+llvm::cl::opt<unsigned> calls("calls", llvm::cl::desc("Number of calls made by every function."),
+							  llvm::cl::init(4));
+
+llvm::cl::opt<unsigned> seed("seed", llvm::cl::desc("Seed of the random number generator."),
+							 llvm::cl::init(1));
+
+/**
+ * A table nested `level` levels deep: `{ i32* @g, i32 (i32)* @f, <next level> }`,
+ * with the innermost level being `{ i32* @g, i32 (i32)* @f }`.
+ */
+llvm::Constant *createTable(std::mt19937 &random, unsigned level,
+							const std::vector<llvm::GlobalVariable *> &globals,
+							const std::vector<llvm::Function *> &functions)
+{
+	std::vector<llvm::Constant *> fields = {globals[random() % globals.size()],
+											functions[random() % functions.size()]};
+	if (level > 1)
+	{
+		fields.push_back(createTable(random, level - 1, globals, functions));
+	}
+	return llvm::ConstantStruct::getAnon(context, fields);
+}
+
+int main(int argc, char **argv)
+{
+	llvm::cl::ParseCommandLineOptions(argc, argv);
+	if (functionCount == 0 || globalCount == 0 || depth == 0)
+	{
+		llvm::errs() << "--functions, --globals and --depth must be at least 1\n";
+		return 1;
+	}
+
+	std::mt19937 random(seed);
+	auto module = std::make_unique<llvm::Module>("generated", context);
+	auto int32 = llvm::Type::getInt32Ty(context);
+	auto functionType = llvm::FunctionType::get(int32, {int32}, false);
+
+	std::vector<llvm::GlobalVariable *> globals;
+	for (unsigned i = 0; i < globalCount; i++)
+	{
+		auto linkage = i % 4 == 3 ? llvm::GlobalValue::InternalLinkage
+								  : llvm::GlobalValue::ExternalLinkage;
+		globals.push_back(new llvm::GlobalVariable(*module, int32, false, linkage,
+												   llvm::ConstantInt::get(int32, i),
+												   "g" + std::to_string(i)));
+	}
+
+	// Create all of the functions first, so that they can call any other one.
+	std::vector<llvm::Function *> functions;
+	for (unsigned i = 0; i < functionCount; i++)
+	{
+		auto linkage = i % 4 == 3 ? llvm::GlobalValue::InternalLinkage
+								  : llvm::GlobalValue::ExternalLinkage;
+		functions.push_back(
+			llvm::Function::Create(functionType, linkage, "f" + std::to_string(i), *module));
+	}
+
+	std::vector<llvm::GlobalVariable *> tables;
+	unsigned tablesWanted = tableCount > 0 ? tableCount : std::max(1u, functionCount / 16);
+	for (unsigned i = 0; i < tablesWanted; i++)
+	{
+		auto table = createTable(random, depth, globals, functions);
+		tables.push_back(new llvm::GlobalVariable(*module, table->getType(), true,
+												  llvm::GlobalValue::ExternalLinkage, table,
+												  "t" + std::to_string(i)));
+	}
+
+	llvm::IRBuilder<> builder(context);
+	for (auto function : functions)
+	{
+		builder.SetInsertPoint(llvm::BasicBlock::Create(context, "entry", function));
+
+		auto global = globals[random() % globals.size()];
+		llvm::Value *value =
+			builder.CreateAdd(function->getArg(0), builder.CreateLoad(int32, global));
+
+		// The first field of the outermost level points to a global.
+		auto table = tables[random() % tables.size()];
+		auto field = builder.CreateStructGEP(table->getValueType(), table, 0);
+		auto pointer = builder.CreateLoad(global->getType(), field);
+		value = builder.CreateAdd(value, builder.CreateLoad(int32, pointer));
+
+		for (unsigned i = 0; i < calls; i++)
+		{
+			auto callee = functions[random() % functions.size()];
+			value = builder.CreateAdd(value, builder.CreateCall(callee, {value}));
+		}
+		builder.CreateRet(value);
+	}
+
+	auto mainFunction = llvm::Function::Create(llvm::FunctionType::get(int32, false),
+											   llvm::GlobalValue::ExternalLinkage, "main",
+											   *module);
+	builder.SetInsertPoint(llvm::BasicBlock::Create(context, "entry", mainFunction));
+	builder.CreateRet(builder.CreateCall(functions[0], {llvm::ConstantInt::get(int32, 0)}));
+
+	if (llvm::verifyModule(*module, &llvm::errs()))
+	{
+		return 1;
+	}
+
+	std::error_code ec;
+	llvm::raw_fd_ostream output(outputFilename, ec);
+	if (ec)
+	{
+		llvm::errs() << outputFilename << ": " << ec.message() << "\n";
+		return 1;
+	}
+	llvm::WriteBitcodeToFile(*module, output);
+
+	std::cout << functionCount << " functions, " << globalCount << " globals, "
+			  << tablesWanted << " tables of depth " << depth << ", " << calls
+			  << " calls per function" << std::endl;
+}